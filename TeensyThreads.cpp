@@ -25,6 +25,9 @@
 #include "TeensyThreads.h"
 #include <Arduino.h>
 #include <string.h>
+#include <stdarg.h>
+#include <reent.h>
+#include <new>
 
 #ifndef __IMXRT1062__
 
@@ -35,6 +38,31 @@ IntervalTimer context_timer;
 
 Threads threads;
 
+// newlib heap and environment locks; see __malloc_lock() at the end
+static Threads::RecursiveMutex malloc_mutex;
+static Threads::RecursiveMutex env_mutex;
+
+/*
+ * Take a heap lock. While the scheduler is locked, the thread holding it
+ * can't run to release it, so waiting would never end; with interrupts
+ * masked, or inside an interrupt, the yield that waits would HardFault.
+ * In those cases take it only if it is free, and otherwise fail at once in
+ * threads_alloc_deadlock() (weak; traps by default) instead.
+ */
+extern "C" void threads_alloc_deadlock_default() {
+  __builtin_trap();
+}
+extern "C" void threads_alloc_deadlock(void) __attribute__ ((weak, alias("threads_alloc_deadlock_default")));
+
+static void heap_lock(Threads::RecursiveMutex &m) {
+  uint32_t ipsr, primask, basepri;
+  __asm__ volatile("mrs %0, ipsr" : "=r" (ipsr));
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __asm__ volatile("mrs %0, basepri" : "=r" (basepri));
+  if (currentLock == 0 && ipsr == 0 && primask == 0 && basepri == 0) m.lock();
+  else if (! m.try_lock()) threads_alloc_deadlock();
+}
+
 unsigned int time_start;
 unsigned int time_end;
 
@@ -51,20 +79,101 @@ extern "C" {
   void *currentSave;
   int currentMSP;             // Stack pointers to save
   void *currentSP;
+  int currentTickCheck;       // call context_switch_tick() on every tick
+  void *currentTP;            // thread pointer returned by __aeabi_read_tp()
+  volatile int currentLock;   // scheduler lock depth; switches wait while set
+  volatile int currentDeferred; // a switch came due while locked
+  volatile uint32_t currentReadyMask = 1; // thread 0 is always ready
+  uint32_t currentBit = 1;
   void loadNextThread() {
     threads.getNextThread();
   }
+  int context_switch_tick() {
+    return threads.tick();
+  }
 }
 
 const int overflow_stack_size = 8;
+const int stack_guard_size = 32;  // smallest MPU region; SIZE field is log2(size)-1
+
+uint8_t *stack_guard_base(ThreadInfo *tp);
+
+#if THREADS_NEWLIB_REENT
+static struct _reent *reent0;  // thread 0 keeps the startup newlib state
+
+static void reent_init(ThreadInfo *tp) {
+  if (tp->reent == 0) tp->reent = new struct _reent;
+  else _reclaim_reent(tp->reent);
+  _REENT_INIT_PTR(tp->reent);
+}
+#endif
+
+#if THREADS_TLS_SIZE
+/*
+ * Every thread gets its own copy of the __thread variables. The compiler
+ * addresses them relative to the thread pointer from __aeabi_read_tp() (in
+ * the asm file), which for ARM points 8 bytes before the TLS block. The
+ * initial values come from .tdata if the linker script marks it with
+ * __tdata_start/__tdata_end; otherwise variables start at zero.
+ */
+extern "C" char __tdata_start[] __attribute__((weak));
+extern "C" char __tdata_end[] __attribute__((weak));
+static uint8_t tls_block0[THREADS_TLS_SIZE] __attribute__((aligned(8)));
+
+static void tls_init(ThreadInfo *tp) {
+  int n = 0;
+  if (__tdata_start && __tdata_end) n = __tdata_end - __tdata_start;
+  if (n > THREADS_TLS_SIZE) n = THREADS_TLS_SIZE;
+  if (n) memcpy(tp->tls_block, __tdata_start, n);
+  memset(tp->tls_block + n, 0, THREADS_TLS_SIZE - n);
+}
+#endif
 
 extern "C" void stack_overflow_default_isr() { 
+  // thread 0 (checked with THREADS_PSP_ONLY) is setup()/loop() and can't be
+  // ended, so it is only reported to a user hook
+  if (threads.id() == 0) return;
   currentThread->flags = Threads::ENDED;
 }
 extern "C" void stack_overflow_isr(void)       __attribute__ ((weak, alias("stack_overflow_default_isr")));
 
 extern unsigned long _estack;   // the main thread 0 stack
 
+#ifdef THREADS_PSP_ONLY
+#ifdef __IMXRT1062__
+// Teensy 4 gives the stack all of RAM1 past the variables, so thread 0's
+// stack size is known exactly and can be checked like the others
+extern unsigned long _ebss;
+#define THREAD0_STACK_CHECKED 1
+#else
+#define THREAD0_STACK_CHECKED 0
+#endif
+
+static uint8_t msp_stack[THREADS_MSP_SIZE] __attribute__((aligned(8)));
+
+/*
+ * Move thread mode to PSP, starting at the current stack pointer, so
+ * setup()/loop() keep their stack where it is, and give MSP to interrupts.
+ */
+static void __attribute__((noinline)) move_to_psp()
+{
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+  __asm__ volatile(
+    "mrs r0, msp        \n"
+    "msr psp, r0        \n"
+    "mrs r0, control    \n"
+    "orr r0, r0, #2     \n"  // SPSEL: thread mode uses PSP
+    "msr control, r0    \n"
+    "isb                \n"
+    "msr msp, %0        \n"
+    :: "r" (msp_stack + sizeof(msp_stack)) : "r0", "memory");
+  __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+}
+#else
+#define THREAD0_STACK_CHECKED 0
+#endif
+
 // static void threads_svcall_isr(void);
 // static void threads_systick_isr(void);
 
@@ -147,15 +256,15 @@ static void __attribute((naked, noinline)) gpt2_isr() {
   __asm volatile("b context_switch");
 }
 
+// keep track of which GPT timer we are using for ticks
+static int gpt_number = 0;
+
 bool gtp1_init(unsigned int microseconds)
 {
   // Initialization code derived from @manitou48.
   // See https://github.com/manitou48/teensy4/blob/master/gpt_isr.ino
   // See https://forum.pjrc.com/threads/54265-Teensy-4-testing-mbed-NXP-MXRT1050-EVKB-(600-Mhz-M7)?p=193217&viewfull=1#post193217
 
-  // keep track of which GPT timer we are using
-  static int gpt_number = 0;
-
   // not configured yet, so find an inactive GPT timer
   if (gpt_number == 0) {
     if (! NVIC_IS_ENABLED(IRQ_GPT1)) {
@@ -202,7 +311,104 @@ bool gtp1_init(unsigned int microseconds)
   return true;
 }
 
+/*
+ * Teensy 4:
+ * Use MPU region 15 (the highest priority region, above the ones set up
+ * by the core at startup) as a no-access guard at the bottom of the running
+ * thread's stack. It is moved on every context switch, so an overflow faults
+ * on the offending access instead of being found at the next switch.
+ */
+
+#ifndef SCB_MPU_RASR_AP
+#define SCB_MPU_RASR_AP(n)  ((uint32_t)(((n) & 7) << 24))
+#endif
+#ifndef SCB_SHCSR_MEMFAULTENA
+#define SCB_SHCSR_MEMFAULTENA ((uint32_t)(1<<16))
+#endif
+
+const int stack_guard_region = 15;
+
+int stack_guard_enabled = 0;
+int stack_guard_fault = 0;
+IsrFunction stack_guard_saved_isr;
+
+/*
+ * Disable the guard or move it to the bottom of "tp"'s stack, just above
+ * the marker word so testStackMarkers() can still read it.
+ */
+static void stack_guard_set(ThreadInfo *tp)
+{
+  uint32_t base = (uint32_t)stack_guard_base(tp);
+  SCB_MPU_RNR = stack_guard_region;
+  if (base == 0) {
+    SCB_MPU_RASR = 0;
+  }
+  else {
+    SCB_MPU_RBAR = base | SCB_MPU_RBAR_VALID | SCB_MPU_RBAR_REGION(stack_guard_region);
+    SCB_MPU_RASR = SCB_MPU_RASR_XN | SCB_MPU_RASR_AP(0) | SCB_MPU_RASR_SIZE(4) | SCB_MPU_RASR_ENABLE;
+  }
+  __asm volatile("dsb");
+  __asm volatile("isb");
+}
+
+/*
+ * Called from the MemManage fault. A data access inside the guard, or a
+ * failed exception stacking or lazy FP save while a guard is active, is a
+ * stack overflow of the running thread. Anything else is passed to the
+ * previous handler.
+ */
+extern "C" void stack_guard_isr()
+{
+  uint32_t cfsr = SCB_CFSR;
+  uint32_t base = (uint32_t)stack_guard_base(currentThread);
+  stack_guard_fault = 0;
+  if (! stack_guard_enabled || base == 0) return;
+  if ((cfsr & 0x80) && SCB_MMFAR - base < (uint32_t)stack_guard_size) stack_guard_fault = 1; // MMARVALID
+  if (cfsr & 0x30) stack_guard_fault = 1; // MSTKERR, MLSPERR
+  if (! stack_guard_fault) return;
+  SCB_CFSR = cfsr & 0xFF;  // clear MemManage status bits
+  // threads.id() is still the offending thread inside the hook
+  stack_overflow_isr();
+  // the stack is exhausted, so the thread cannot continue regardless
+  currentThread->flags = Threads::ENDED;
+  // a scheduler lock held by the thread dies with it
+  currentLock = 0;
+  currentDeferred = 0;
+  stack_guard_set(NULL);
+}
+
+static void __attribute((naked, noinline)) threads_memfault_isr()
+{
+  asm volatile("push {r0-r4,lr}");
+  stack_guard_isr();
+  asm volatile("pop {r0-r4,lr}");
+  if (stack_guard_fault) {
+    // the faulting thread can't resume, so switch even if threading is stopped
+    __asm volatile("b context_switch_direct_active");
+  }
+  __asm volatile("ldr r0, =stack_guard_saved_isr \n"
+                 "ldr r0, [r0] \n"
+                 "bx r0");
+}
+
+#endif
+
+/*
+ * Lowest address covered by the stack guard of thread "tp", or 0 if it
+ * has none. Thread 0 runs on MSP and small stacks are not guarded.
+ */
+uint8_t *stack_guard_base(ThreadInfo *tp)
+{
+#ifdef __IMXRT1062__
+  if (tp == NULL || tp == threads.threadp[0] || tp->stack == NULL) return 0;
+  uint32_t base = ((uint32_t)tp->stack + sizeof(uint32_t) + stack_guard_size - 1) & ~(stack_guard_size - 1);
+  if (base + stack_guard_size + Threads::STACK_GUARD_MIN > (uint32_t)tp->stack + tp->stack_size) return 0;
+  return (uint8_t*)base;
+#else
+  (void)tp;
+  return 0;
 #endif
+}
 
 /*************************************************/
 /**\name UTILITIES FUNCTIONS                     */
@@ -231,6 +437,12 @@ char * _util_state_2_string(int state){
     case 4:
         sprintf(_state, "SUSPENDED");
         break;
+    case 5:
+        sprintf(_state, "WAITING");
+        break;
+    case 6:
+        sprintf(_state, "THROTTLED");
+        break;
     default:
         sprintf(_state, "%d", state);
         break;
@@ -239,6 +451,14 @@ char * _util_state_2_string(int state){
     return _state;
 }
 
+/*
+ * StaticThreads constructed before "threads" wait here for its constructor.
+ * Both variables are zero before any constructor runs, so the order in which
+ * the constructors run doesn't matter.
+ */
+static Threads::StaticThread *static_pending = 0;
+static int static_ready = 0;
+
 /*************************************************/
 /**\name CLASS THREAD                            */
 /*************************************************/
@@ -253,7 +473,12 @@ Threads::Threads() : current_thread(0), thread_count(0), thread_error(0) {
   // initialize context_switch() globals from thread 0, which is MSP and always running
   currentThread = threadp[0];        // thread 0 is active
   currentSave = &threadp[0]->save;
+#ifdef THREADS_PSP_ONLY
+  move_to_psp();
+  currentMSP = 0;
+#else
   currentMSP = 1;
+#endif
   currentSP = 0;
   currentCount = Threads::DEFAULT_TICKS;
   currentActive = FIRST_RUN;
@@ -261,10 +486,24 @@ Threads::Threads() : current_thread(0), thread_count(0), thread_error(0) {
   threadp[0]->ticks = DEFAULT_TICKS;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Warray-bounds"
+#if THREAD0_STACK_CHECKED
+  threadp[0]->stack = (uint8_t*)(((uint32_t)&_ebss + 7) & ~7);
+  threadp[0]->stack_size = (uint8_t*)&_estack - threadp[0]->stack;
+#else
   threadp[0]->stack = (uint8_t*)&_estack - DEFAULT_STACK0_SIZE;
-#pragma GCC diagnostic pop
   threadp[0]->stack_size = DEFAULT_STACK0_SIZE;
+#endif
+#pragma GCC diagnostic pop
   setStackMarker(threadp[0]->stack);
+#if THREADS_NEWLIB_REENT
+  reent0 = _impure_ptr;
+  threadp[0]->reent = reent0;
+#endif
+#if THREADS_TLS_SIZE
+  threadp[0]->tls_block = tls_block0;
+  tls_init(threadp[0]);
+  currentTP = threadp[0]->tls_block - 8;
+#endif
 
 #ifdef __IMXRT1062__
 
@@ -297,6 +536,14 @@ Threads::Threads() : current_thread(0), thread_count(0), thread_error(0) {
 #endif
 
 #endif
+
+  // give slots to the static threads constructed before us
+  static_ready = 1;
+  while (static_pending) {
+    StaticThread *st = static_pending;
+    static_pending = st->next;
+    addStaticThread(st);
+  }
 }
 
 /*
@@ -340,34 +587,207 @@ void Threads::getNextThread() {
 
   // First, save the currentSP set by context_switch
   currentThread->sp = currentSP;
+  currentDeferred = 0;
+
+  // running low on stack with a larger one ready? (a thread only restarts
+  // from RUNNING so it can't be registered as waiting on anything)
+  if (current_thread && currentThread->grow_stack && currentThread->flags != ENDED &&
+      ((uint8_t*)currentThread->sp - currentThread->stack <= STACK_GROW_MARGIN) &&
+      (currentThread->grow_mode == GROW_RELOCATE || currentThread->flags == RUNNING)) {
+    growStack(currentThread);
+  }
 
   // did we overflow the stack (don't check thread 0)?
   // allow an extra 8 bytes for a call to the ISR and one additional call or variable
-  if (current_thread && ((uint8_t*)currentThread->sp - currentThread->stack <= overflow_stack_size)) {
+  // a thread already ENDED by the stack guard fault was reported there
+  if ((current_thread || THREAD0_STACK_CHECKED) && currentThread->flags != ENDED &&
+      ((uint8_t*)currentThread->sp - currentThread->stack <= overflow_stack_size)) {
     stack_overflow_isr();
   }
 
-  // Find the next running thread
-  while(1) {
-    current_thread++;
-    if (current_thread >= MAX_THREADS) {
-      current_thread = 0; // thread 0 is MSP; always active so return
-      break;
+  // Periodic threads with a released job go first; otherwise find the
+  // next running thread round-robin. Only the round-robin moves rr_thread,
+  // so after any other pick it carries on where it left off.
+  int next = periodic_count ? getNextPeriodic() : -1;
+  int donated = 0;
+  if (wake_thread >= 0) {
+    // a thread just woken or handed the CPU runs first, unless a periodic
+    // job is ready and it isn't that job; otherwise it waits for its turn
+    if (threadp[wake_thread]->flags == RUNNING && (next < 0 || next == wake_thread)) {
+      next = wake_thread;
+      donated = handoff_count;
+    }
+    wake_thread = -1;
+    handoff_count = 0;
+  }
+  if (next >= 0) {
+    // a round-robin thread preempted by this pick gets the rest of its
+    // slice back later, unless it gave it away
+    if (current_thread == rr_thread) {
+      rr_left = (donated > 0 || next == rr_thread) ? 0 : currentCount;
+    }
+    current_thread = next;
+  }
+  else if (rr_left > 0 && current_thread != rr_thread && threadp[rr_thread] &&
+           threadp[rr_thread]->flags == RUNNING) {
+    current_thread = rr_thread;
+    donated = rr_left;
+    rr_left = 0;
+  }
+  else {
+    rr_left = 0;
+    while(1) {
+      rr_thread++;
+      if (rr_thread >= MAX_THREADS) {
+        rr_thread = 0; // thread 0 is MSP; always active so return
+        break;
+      }
+      ThreadInfo *tp = threadp[rr_thread];
+      if (tp == NULL || tp->flags != RUNNING) {
+        currentReadyMask &= ~(1 << rr_thread); // not ready; see markReady()
+        continue;
+      }
+      if (! tp->periodic) break;
     }
-    if (threadp[current_thread] && threadp[current_thread]->flags == RUNNING) break;
+    current_thread = rr_thread;
   }
-  currentCount = threadp[current_thread]->ticks;
+  currentCount = donated > 0 ? donated : threadp[current_thread]->ticks;
+  currentBit = 1 << current_thread;
 
   currentThread = threadp[current_thread];
   currentSave = &threadp[current_thread]->save;
+#ifndef THREADS_PSP_ONLY
   currentMSP = (current_thread==0?1:0);
+#endif
   currentSP = threadp[current_thread]->sp;
+#if THREADS_TLS_SIZE
+  currentTP = currentThread->tls_block - 8;
+#endif
+#if THREADS_NEWLIB_REENT
+  _impure_ptr = currentThread->reent;
+#endif
+
+#ifdef __IMXRT1062__
+  if (stack_guard_enabled) stack_guard_set(currentThread);
+#endif
 
 #ifdef DEBUG
   currentThread->cyclesStart = ARM_DWT_CYCCNT;
 #endif
 }
 
+/*
+ * getNextPeriodic() - Find the periodic thread whose job should run next
+ *
+ * Returns -1 if no periodic thread has a job ready.
+ */
+int Threads::getNextPeriodic() {
+  int best = -1;
+  uint32_t best_key = 0;
+  for (int i=1; i<MAX_THREADS; i++) {
+    ThreadInfo *tp = threadp[i];
+    if (tp == NULL || tp->periodic == NULL || tp->flags != RUNNING) continue;
+    ThreadPeriodic *pp = tp->periodic;
+    if (periodic_policy == RATE_MONOTONIC) {
+      if (best < 0 || pp->period_us < best_key) {
+        best = i;
+        best_key = pp->period_us;
+      }
+    }
+    else {
+      uint32_t deadline = pp->job_us + pp->deadline_us;
+      if (best < 0 || (int32_t)(deadline - best_key) < 0) {
+        best = i;
+        best_key = deadline;
+      }
+    }
+  }
+  return best;
+}
+
+/*
+ * tick() - Per-tick scheduler work, called from context_switch()
+ *
+ * Runs with interrupts disabled and only while currentTickCheck is set.
+ * Releases the jobs of periodic threads whose period has come around and
+ * charges the running thread one tick against its CPU budget.
+ * Returns 1 if the running thread should be switched out now.
+ */
+int Threads::tick() {
+  int ret = 0;
+  if (budget_count) {
+    // Budgets are sampled: whoever is running when the tick fires pays for it
+    for (int i=1; i<MAX_THREADS; i++) {
+      ThreadInfo *tp = threadp[i];
+      if (tp == NULL || tp->budget_ticks == 0) continue;
+      if (--tp->budget_window <= 0) {
+        tp->budget_window = tp->budget_period;
+        tp->budget_used = 0;
+        if (tp->flags == THROTTLED) {
+          tp->flags = RUNNING;
+          markReady(i);
+        }
+      }
+    }
+    ThreadInfo *tp = currentThread;
+    if (tp->budget_ticks && tp->flags == RUNNING && ++tp->budget_used >= tp->budget_ticks) {
+      tp->flags = THROTTLED;
+      tp->budget_overruns++;
+      if (budget_callback) budget_callback(current_thread);
+      ret = 1;
+    }
+  }
+  if (periodic_count) {
+    uint32_t now = micros();
+    for (int i=1; i<MAX_THREADS; i++) {
+      ThreadInfo *tp = threadp[i];
+      if (tp == NULL || tp->periodic == NULL) continue;
+      ThreadPeriodic *pp = tp->periodic;
+      if ((int32_t)(now - pp->release_us) >= 0) {
+        pp->pending++;
+        pp->release_us += pp->period_us;
+        if (tp->flags == WAITING) {
+          tp->flags = RUNNING;
+          markReady(i);
+          ret = 1;
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+/*
+ * Turn the per-tick call to tick() on only when it has something to do
+ */
+void Threads::updateTickCheck() {
+  currentTickCheck = (periodic_count != 0 || budget_count != 0);
+}
+
+/*
+ * setStackGuard() - Trap stack overflows in hardware (Teensy 4 only)
+ *
+ * Returns 1 if the guard is supported and was changed, 0 otherwise.
+ */
+int Threads::setStackGuard(bool enable)
+{
+#ifdef __IMXRT1062__
+  __disable_irq();
+  if (enable && ! stack_guard_enabled) {
+    stack_guard_saved_isr = _VectorsRam[4];
+    _VectorsRam[4] = threads_memfault_isr;
+    SCB_SHCSR |= SCB_SHCSR_MEMFAULTENA;
+  }
+  stack_guard_enabled = enable;
+  stack_guard_set(enable ? currentThread : NULL);
+  __enable_irq();
+  return 1;
+#else
+  (void)enable;
+  return 0;
+#endif
+}
+
 /*
  * Empty placeholder for IntervalTimer class
  */
@@ -452,124 +872,780 @@ int Threads::setSliceMillis(int milliseconds)
 }
 
 /*
- * del_process() - This is called when the task returns
+ * Wake timer
  *
- * Turns thread off. Thread continues running until next call to
- * context_switch() at which point it all stops. The while(1) statement
- * just stalls until such time.
+ * A one-shot timer wakes threads blocked by sleepUntil() at the exact
+ * microsecond instead of at the next tick. Teensy 4 uses the GPT not taken
+ * for ticks, running free at 1MHz with a compare. Teensy 3 uses a PIT
+ * channel reserved through IntervalTimer and loaded for a single count.
+ * The interrupt has the lowest priority so it only ever interrupts a thread,
+ * and it switches straight to the woken thread.
  */
-void Threads::del_process(void)
+
+int wake_timer_state = 0;    // 0 = not set up yet, 1 = ready, -1 = no timer free
+int wake_switch = 0;         // set by wake_timer_run() when a thread was woken
+const int wake_min_us = 2;   // shortest delay we can safely program
+
+#ifdef __IMXRT1062__
+static int wake_gpt = 0;
+#else
+IntervalTimer wake_timer;
+static volatile uint32_t *wake_pit;   // LDVAL, CVAL, TCTRL, TFLG of our channel
+#endif
+
+extern "C" void context_switch_direct_isr(void);
+extern "C" void wake_timer_run() {
+  threads.wakeRun();
+}
+
+static void __attribute((naked, noinline)) wake_timer_isr()
 {
-  int old_state = threads.stop();
-  ThreadInfo *me = threads.threadp[threads.current_thread];
-  // Would love to delete stack here but the thread doesn't
-  // end now. It continues until the next tick.
-  // if (me->my_stack) {
-  //   delete[] me->stack;
-  //   me->stack = 0;
-  // }
-  threads.thread_count--;
-  me->flags = ENDED; //clear the flags so thread can stop and be reused
-  threads.start(old_state);
-  while(1); // just in case, keep working until context change when execution will not return to this thread
+  asm volatile("push {r0-r4,lr}");
+  wake_timer_run();
+  asm volatile("pop {r0-r4,lr}");
+  if (wake_switch) {
+    __asm volatile("b context_switch_direct_isr");
+  }
+  __asm volatile("bx lr");
+}
+
+static int wake_timer_setup()
+{
+#ifdef __IMXRT1062__
+  if (gpt_number != 1 && ! NVIC_IS_ENABLED(IRQ_GPT1)) {
+    wake_gpt = 1;
+    CCM_CCGR1 |= CCM_CCGR1_GPT1_BUS(CCM_CCGR_ON) | CCM_CCGR1_GPT1_SERIAL(CCM_CCGR_ON);
+    GPT1_CR = 0;
+    GPT1_PR = 23;                 // 1 tick = 1 microsecond at 24MHz
+    GPT1_SR = 0x3F;
+    GPT1_IR = 0;
+    GPT1_CR = GPT_CR_EN | GPT_CR_CLKSRC(1) | GPT_CR_FRR;  // free running
+    attachInterruptVector(IRQ_GPT1, &wake_timer_isr);
+    NVIC_SET_PRIORITY(IRQ_GPT1, 255);
+    NVIC_ENABLE_IRQ(IRQ_GPT1);
+  }
+  else if (gpt_number != 2 && ! NVIC_IS_ENABLED(IRQ_GPT2)) {
+    wake_gpt = 2;
+    CCM_CCGR0 |= CCM_CCGR0_GPT2_BUS(CCM_CCGR_ON) | CCM_CCGR0_GPT2_SERIAL(CCM_CCGR_ON);
+    GPT2_CR = 0;
+    GPT2_PR = 23;
+    GPT2_SR = 0x3F;
+    GPT2_IR = 0;
+    GPT2_CR = GPT_CR_EN | GPT_CR_CLKSRC(1) | GPT_CR_FRR;
+    attachInterruptVector(IRQ_GPT2, &wake_timer_isr);
+    NVIC_SET_PRIORITY(IRQ_GPT2, 255);
+    NVIC_ENABLE_IRQ(IRQ_GPT2);
+  }
+  else {
+    return 0;
+  }
+#else
+  wake_timer.priority(255);
+  if (wake_timer.begin(context_pit_empty, 1000000) == 0) return 0;
+  int number = (IRQ_NUMBER_t)wake_timer - IRQ_PIT_CH0;
+  const int width = (PIT_TFLG1 - PIT_TFLG0) / sizeof(uint32_t);
+  wake_pit = &PIT_LDVAL0 + (width * number);
+  wake_pit[2] = 0;             // stop it until armed
+  wake_pit[3] = 1;
+  attachInterruptVector(wake_timer, wake_timer_isr);
+#endif
+  return 1;
 }
 
 /*
- * Set a marker at memory so we can detect memory overruns
+ * Claim the wake timer on first use. Interrupts are off during the setup so
+ * two threads can't both claim a timer, or one see it half set up.
  */
+static int wake_timer_begin()
+{
+  if (wake_timer_state) return wake_timer_state > 0;
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+  if (! wake_timer_state) wake_timer_state = wake_timer_setup() ? 1 : -1;
+  __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+  return wake_timer_state > 0;
+}
 
-const uint32_t thread_marker = 0xDEADDEAD;
+static void wake_timer_arm(uint32_t delay_us)
+{
+  if (delay_us < (uint32_t)wake_min_us) delay_us = wake_min_us;
+#ifdef __IMXRT1062__
+  if (wake_gpt == 1) {
+    GPT1_OCR1 = GPT1_CNT + delay_us;
+    GPT1_SR = GPT_SR_OF1;
+    GPT1_IR = GPT_IR_OF1IE;
+  }
+  else {
+    GPT2_OCR1 = GPT2_CNT + delay_us;
+    GPT2_SR = GPT_SR_OF1;
+    GPT2_IR = GPT_IR_OF1IE;
+  }
+#else
+  wake_pit[2] = 0;
+  wake_pit[0] = delay_us * (F_BUS / 1000000) - 1;
+  wake_pit[3] = 1;
+  wake_pit[2] = PIT_TCTRL_TIE | PIT_TCTRL_TEN;
+#endif
+}
 
-void Threads::setStackMarker(void *stack)
+static void wake_timer_stop()
 {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Warray-bounds"
-  uint32_t *m = (uint32_t*)stack;
-  *m = thread_marker;
-#pragma GCC diagnostic pop
+#ifdef __IMXRT1062__
+  if (wake_gpt == 1) {
+    GPT1_IR = 0;
+    GPT1_SR = GPT_SR_OF1;
+  }
+  else {
+    GPT2_IR = 0;
+    GPT2_SR = GPT_SR_OF1;
+  }
+  __asm volatile ("dsb");
+#else
+  wake_pit[2] = 0;
+  wake_pit[3] = 1;
+#endif
 }
 
 /*
- * Users call this function to see if stack has been corrupted
+ * Run the wake timer's interrupt now, so that a thread woken by an interrupt
+ * handler is switched to as soon as interrupts are done. If there's no wake
+ * timer, the woken thread just runs at its turn.
  */
-int Threads::testStackMarkers(int *threadid)
+static volatile int wake_signal = 0;
+
+static void wake_timer_pend()
 {
-  for (int i=0; i < MAX_THREADS; i++) {
-    if (threadp[i] == NULL) continue;
-    if (threadp[i]->flags == RUNNING) {
-      uint32_t *m = (uint32_t*)threadp[i]->stack;
-      if (*m != thread_marker) {
-        if (threadid) *threadid = i;
-        return -1;
-      }
-    }
+  if (wake_timer_state <= 0) return;
+  wake_signal = 1;
+#ifdef __IMXRT1062__
+  NVIC_SET_PENDING(wake_gpt == 1 ? IRQ_GPT1 : IRQ_GPT2);
+#else
+  NVIC_SET_PENDING((IRQ_NUMBER_t)wake_timer);
+#endif
+}
+
+/*
+ * Program the wake timer for the earliest sleeping thread, or stop it.
+ * Call with interrupts disabled.
+ */
+void Threads::wakeArm(uint32_t now)
+{
+  int found = 0;
+  uint32_t next = 0;
+  for (int i=1; i<MAX_THREADS; i++) {
+    ThreadInfo *tp = threadp[i];
+    if (tp == NULL || ! tp->wake_set) continue;
+    if (! found || (int32_t)(tp->wake_us - next) < 0) next = tp->wake_us;
+    found = 1;
   }
-  return 0;
+  if (! found) wake_timer_stop();
+  else if ((int32_t)(next - now) <= 0) wake_timer_arm(0);
+  else wake_timer_arm(next - now);
 }
 
 /*
- * Initializes a thread's stack. Called when thread is created
+ * Wake timer interrupt: make due threads RUNNING and re-arm for the next.
+ * The earliest woken thread is handed to getNextThread() to run first.
  */
-void *Threads::loadstack(ThreadFunction p, void * arg, void *stackaddr, int stack_size)
+void Threads::wakeRun()
 {
-  interrupt_stack_t * process_frame = (interrupt_stack_t *)((uint8_t*)stackaddr + stack_size - sizeof(interrupt_stack_t) - overflow_stack_size);
-  process_frame->r0 = (uint32_t)arg;
-  process_frame->r1 = 0;
-  process_frame->r2 = 0;
-  process_frame->r3 = 0;
-  process_frame->r12 = 0;
-  process_frame->lr = (uint32_t)Threads::del_process;
-  process_frame->pc = ((uint32_t)p);
-  process_frame->xpsr = 0x1000000;
-  uint8_t *ret = (uint8_t*)process_frame;
-  // ret -= sizeof(software_stack_t); // uncomment this if we are saving R4-R11 to the stack
-  return (void*)ret;
+  wake_timer_stop();
+  wake_switch = 0;
+  uint32_t now = micros();
+  for (int i=1; i<MAX_THREADS; i++) {
+    ThreadInfo *tp = threadp[i];
+    if (tp == NULL || ! tp->wake_set) continue;
+    if ((int32_t)(now - tp->wake_us) < 0) continue;
+    tp->wake_set = 0;
+    if (tp->flags == WAITING) {
+      tp->flags = RUNNING;
+      markReady(i);
+      if (! wake_switch) wake_thread = i;
+      wake_switch = 1;
+    }
+  }
+  if (wake_signal) { // pended by wake_timer_pend(); wake_thread is set
+    wake_signal = 0;
+    wake_switch = 1;
+  }
+  wakeArm(now);
 }
 
 /*
- * Add a new thread to the queue.
- *    add_thread(fund, arg)
+ * handoffTo() - Run thread id next, with the rest of the current slice
  *
- *    fund : is a function pointer. The function prototype is:
- *           void *func(void *param)
- *    arg  : is a void pointer that is passed as the first parameter
- *           of the function. In the example above, arg is passed
- *           as param.
- *    stack_size : the size of the buffer pointed to by stack. If
- *           it is 0, then "stack" must also be 0. If so, the function
- *           will allocate the default stack size of the heap using new().
- *    stack : pointer to new data stack of size stack_size. If this is 0,
- *           then it will allocate a stack on the heap using new() of size
- *           stack_size. If stack_size is 0, a default size will be used.
- *    return: an integer ID to be used for other calls
+ * Takes effect at the next switch, so wakers follow it with a yield to hand
+ * the CPU over now instead of waiting for the round-robin to get there.
+ * It is ignored if a periodic job other than id is ready then, so a job
+ * that unlocks a Mutex keeps the CPU and its deadline.
  */
-int Threads::addThread(ThreadFunction p, void * arg, int stack_size, void *stack)
+void Threads::handoffTo(int id)
 {
-  int old_state = stop();
-  if (stack_size == -1) stack_size = DEFAULT_STACK_SIZE;
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+  wake_thread = id;
+  handoff_count = currentCount;
+  __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+}
+
+int Threads::yieldTo(int id)
+{
+  if (id < 0 || id >= MAX_THREADS || id == current_thread || threadp[id] == NULL) return 0;
+  if (threadp[id]->flags != RUNNING) return 0;
+  if (periodic_count) {
+    // a ready periodic job goes first anyway; see getNextThread()
+    int job = getNextPeriodic();
+    if (job >= 0 && job != id) return 0;
+  }
+  handoffTo(id);
+  yield();
+  return 1;
+}
+
+/*
+ * waitOn() - Block the current thread until wakeAll() on the same mask
+ *
+ * Call with interrupts disabled, right after finding that the thread must
+ * wait; returns with them enabled. Thread 0 is always scheduled, so for
+ * it this is just a yield. Callers check their condition again in a loop.
+ */
+void Threads::waitOn(volatile uint32_t &waiters)
+{
+  waiters |= (1 << current_thread);
+  if (current_thread) currentThread->flags = WAITING;
+  __enable_irq();
+  yield();
+}
+
+/*
+ * wakeAll() - Make every thread waiting on the mask RUNNING
+ *
+ * Call with interrupts disabled. Returns the number of threads woken. The
+ * first one woken is handed the CPU at the next switch; see handoffTo().
+ */
+int Threads::wakeAll(volatile uint32_t &waiters)
+{
+  int count = 0;
+  int first = -1;
+  uint32_t mask = waiters;
+  waiters = 0;
+  for (int i=0; mask; i++, mask >>= 1) {
+    if ((mask & 1) == 0) continue;
+    if (threadp[i] && threadp[i]->flags == WAITING) {
+      threadp[i]->flags = RUNNING;
+      markReady(i);
+      if (first < 0) first = i;
+    }
+    count++;
+  }
+  if (first >= 0) handoffTo(first);
+  return count;
+}
+
+/*
+ * Set the time at which tp, if WAITING, is made RUNNING by the wake timer.
+ * Call with interrupts disabled.
+ */
+void Threads::setWake(ThreadInfo *tp, uint32_t wake_us)
+{
+  tp->wake_us = wake_us;
+  tp->wake_set = 1;
+  wakeArm(micros());
+}
+
+/*
+ * sleepUntil() - Block the current thread until micros() reaches wake_us
+ *
+ * The thread may also be woken early (by restart(), for example), so
+ * callers check their condition in a loop. Returns 0 without waiting if
+ * the thread can't block: thread 0 is always scheduled, and blocking needs
+ * threading started and a free timer.
+ */
+int Threads::sleepUntil(uint32_t wake_us)
+{
+  if (current_thread == 0 || currentActive != STARTED) return 0;
+  if (! wake_timer_begin()) return 0;
+  __disable_irq();
+  ThreadInfo *tp = currentThread;
+  if ((int32_t)(micros() - wake_us) >= 0) {
+    __enable_irq();
+    return 1;
+  }
+  tp->flags = WAITING;
+  setWake(tp, wake_us);
+  __enable_irq();
+  yield();
+  tp->wake_set = 0;
+  return 1;
+}
+
+/*
+ * del_process() - This is called when the task returns
+ *
+ * Turns thread off. Thread continues running until next call to
+ * context_switch() at which point it all stops. The while(1) statement
+ * just stalls until such time.
+ */
+static void place_free(void *ptr, int place);
+
+void Threads::del_process(void)
+{
+  ThreadInfo *me = threads.threadp[threads.current_thread];
+  // The stack left behind by a growth is no longer in use, so give it back
+  // now rather than when the slot is reused. Heap lock first, as in addThread().
+  heap_lock(malloc_mutex);
+  __disable_irq();
+  uint8_t *retired = me->retired_stack;
+  me->retired_stack = 0;
+  __enable_irq();
+  if (retired) {
+    if (! me->my_arena) me->arena = 0; // it lived in the first stack
+    place_free(retired, me->retired_place);
+  }
+  malloc_mutex.unlock();
+  threads.lockScheduler();
+  // Would love to delete stack here but the thread doesn't
+  // end now. It continues until the next tick.
+  // if (me->my_stack) {
+  //   delete[] me->stack;
+  //   me->stack = 0;
+  // }
+  threads.thread_count--;
+  me->arena_used = 0; // nothing in the arena outlives the thread
+  me->arena_new = 0;
+  me->flags = ENDED; //clear the flags so thread can stop and be reused
+  threads.unlockScheduler();
+  while(1) yield(); // just in case, keep working until context change when execution will not return to this thread
+}
+
+/*
+ * Set a marker at memory so we can detect memory overruns
+ */
+
+const uint32_t thread_marker = 0xDEADDEAD;
+
+void Threads::setStackMarker(void *stack)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Warray-bounds"
+  uint32_t *m = (uint32_t*)stack;
+  *m = thread_marker;
+#pragma GCC diagnostic pop
+}
+
+/*
+ * Fill a stack with STACK_PAINT so that the deepest use can later be found
+ * by getStackHighWater(). The first word is skipped because it holds the
+ * marker. Stores are done a word at a time, four per loop, because this
+ * runs with threading stopped.
+ */
+void Threads::paintStack(void *stack, int stack_size)
+{
+  uint32_t *p = (uint32_t*)(((uint32_t)stack + sizeof(uint32_t) + 3) & ~3);
+  uint32_t *end = (uint32_t*)(((uint32_t)stack + stack_size) & ~3);
+  const uint32_t v = STACK_PAINT;
+  while (end - p >= 4) {
+    p[0] = v;
+    p[1] = v;
+    p[2] = v;
+    p[3] = v;
+    p += 4;
+  }
+  while (p < end) *p++ = v;
+}
+
+/*
+ * Scan a painted stack from the bottom for the first word that was
+ * overwritten. Everything above that word has been used at some point.
+ */
+int Threads::getStackHighWater(int id)
+{
+  ThreadInfo *tp = threadp[id];
+  if (tp == NULL || ! tp->stack_painted) return -1;
+  uint32_t *p = (uint32_t*)(((uint32_t)tp->stack + sizeof(uint32_t) + 3) & ~3);
+  uint32_t *end = (uint32_t*)(((uint32_t)tp->stack + tp->stack_size) & ~3);
+  // reading the guard would fault, and it is never written anyway
+  uint8_t *guard = stack_guard_base(tp);
+  if (guard) p = (uint32_t*)(guard + stack_guard_size);
+  while (p < end && *p == STACK_PAINT) p++;
+  return tp->stack + tp->stack_size - (uint8_t*)p;
+}
+
+/*
+ * Suggest a stack size from the high water mark, leaving 25% plus room
+ * for an interrupt frame and the overflow check. Only meaningful after
+ * the thread has run through its deepest code path.
+ */
+int Threads::getStackSuggested(int id)
+{
+  int used = getStackHighWater(id);
+  if (used < 0) return -1;
+  int size = used + used/4 + STACK_SUGGEST_MARGIN + overflow_stack_size;
+  return (size + 7) & ~7;
+}
+
+/*
+ * DTCM pool: a first-fit list of blocks, each with an 8-byte header. It has
+ * no lock of its own: callers of pool_alloc(), pool_free() and place_free()
+ * hold the heap lock (malloc_mutex).
+ */
+typedef struct {
+  uint32_t size;   // including this header
+  uint32_t used;
+} pool_block_t;
+
+static uint8_t *dtcm_pool = 0;
+static uint8_t *dtcm_pool_end = 0;
+
+static void *pool_alloc(int size) {
+  uint32_t need = (size + sizeof(pool_block_t) + 7) & ~7;
+  for (uint8_t *p = dtcm_pool; p < dtcm_pool_end; p += ((pool_block_t*)p)->size) {
+    pool_block_t *b = (pool_block_t*)p;
+    if (b->used || b->size < need) continue;
+    if (b->size - need >= 64) { // split off the rest
+      pool_block_t *rest = (pool_block_t*)(p + need);
+      rest->size = b->size - need;
+      rest->used = 0;
+      b->size = need;
+    }
+    b->used = 1;
+    return p + sizeof(pool_block_t);
+  }
+  return NULL;
+}
+
+static void pool_free(void *ptr) {
+  ((pool_block_t*)((uint8_t*)ptr - sizeof(pool_block_t)))->used = 0;
+  for (uint8_t *p = dtcm_pool; p < dtcm_pool_end; p += ((pool_block_t*)p)->size) {
+    pool_block_t *b = (pool_block_t*)p;
+    if (b->used) continue;
+    pool_block_t *next = (pool_block_t*)(p + b->size);
+    while ((uint8_t*)next < dtcm_pool_end && ! next->used) { // merge free neighbours
+      b->size += next->size;
+      next = (pool_block_t*)(p + b->size);
+    }
+  }
+}
+
+static void place_free(void *ptr, int place) {
+  if (place == Threads::PLACE_DTCM) pool_free(ptr);
+#if defined(__IMXRT1062__) && defined(ARDUINO_TEENSY41)
+  else if (place == Threads::PLACE_EXTMEM) extmem_free(ptr);
+#endif
+  else delete[] (uint8_t*)ptr;
+}
+
+int Threads::setDTCMPool(void *buffer, int size)
+{
+#ifdef __IMXRT1062__
+  if ((uint32_t)buffer < 0x20000000 || (uint32_t)buffer + size > 0x20080000) return 0;
+#endif
+  uint8_t *start = (uint8_t*)(((uint32_t)buffer + 7) & ~7);
+  size = (size - (start - (uint8_t*)buffer)) & ~7;
+  if (size < 64) return 0;
+  heap_lock(malloc_mutex);
+  dtcm_pool = start;
+  dtcm_pool_end = start + size;
+  ((pool_block_t*)start)->size = size;
+  ((pool_block_t*)start)->used = 0;
+  malloc_mutex.unlock();
+  return 1;
+}
+
+int Threads::setDefaultPlacement(int placement)
+{
+  int old = default_placement;
+  default_placement = placement;
+  return old;
+}
+
+int Threads::getPlacement(int id)
+{
+  if (id < 0 || id >= MAX_THREADS || threadp[id] == NULL) return -1;
+  return threadp[id]->stack_place;
+}
+
+Threads::Placement::Placement(int placement) {
+  save = threads.setDefaultPlacement(placement);
+}
+
+Threads::Placement::~Placement() {
+  threads.setDefaultPlacement(save);
+}
+
+/*
+ * Allocate memory in the default placement, falling back to the heap, and
+ * report where it came from so it can be freed there.
+ */
+uint8_t *Threads::placeAlloc(int size, int *place)
+{
+  void *p = NULL;
+#ifdef __IMXRT1062__
+  if (default_placement == PLACE_DTCM) p = pool_alloc(size);
+#ifdef ARDUINO_TEENSY41
+  else if (default_placement == PLACE_EXTMEM) p = extmem_malloc(size);
+#endif
+#endif
+  if (p) {
+    *place = default_placement;
+    return (uint8_t*)p;
+  }
+  *place = PLACE_OCRAM;
+  return new uint8_t[size];
+}
+
+int Threads::stackClassSize(int stack_size)
+{
+  switch (stack_size) {
+    case STACK_SMALL: return STACK_SMALL_SIZE;
+    case STACK_MEDIUM: return STACK_MEDIUM_SIZE;
+    case STACK_LARGE: return STACK_LARGE_SIZE;
+    default: return stack_size < 0 ? DEFAULT_STACK_SIZE : stack_size;
+  }
+}
+
+int Threads::setStackGrowth(int id, int mode, int stack_size)
+{
+  if (id <= 0 || id >= MAX_THREADS || threadp[id] == NULL) return 0;
+  ThreadInfo *tp = threadp[id];
+  stack_size = stackClassSize(stack_size);
+  uint8_t *grow = 0;
+  if (mode != GROW_NONE) {
+    if (stack_size <= tp->stack_size) return 0;
+    // prepare the block now: the switch can't allocate or spend time painting
+    grow = new uint8_t[stack_size];
+    if (tp->stack_painted) paintStack(grow, stack_size);
+    setStackMarker(grow);
+  }
+  __disable_irq();
+  uint8_t *retired = tp->retired_stack;
+  int retired_place = tp->retired_place;
+  if (retired && tp->arena && ! tp->my_arena) {
+    // the first stack holds the arena and has to stay, so grow only once
+    __enable_irq();
+    if (grow) delete[] grow;
+    return 0;
+  }
+  tp->retired_stack = 0;  // the thread has moved off it for good
+  uint8_t *old = tp->grow_stack;
+  tp->grow_stack = grow;
+  tp->grow_size = stack_size;
+  tp->grow_mode = mode;
+  __enable_irq();
+  if (old) delete[] old;
+  if (retired) {
+    heap_lock(malloc_mutex);
+    place_free(retired, retired_place);
+    malloc_mutex.unlock();
+  }
+  return 1;
+}
+
+int Threads::getStackGrowths(int id)
+{
+  if (id < 0 || id >= MAX_THREADS || threadp[id] == NULL) return 0;
+  return threadp[id]->grow_count;
+}
+
+/*
+ * Switch a thread that is running out of stack to its larger block; called
+ * from the context switch. GROW_RESTART simply starts the thread over.
+ * GROW_RELOCATE copies the used part of the stack to the top of the new block
+ * and moves by the same amount every saved register and stack word that
+ * points into the old stack, which covers frame pointers, saved SPs and
+ * pointers to locals. A value that only looks like such a pointer would be
+ * changed too, so use it for threads that don't keep numbers in that range.
+ * The offset is a multiple of 8 to keep the exception frame alignment. The
+ * old block is kept (an arena may live in it) until the thread ends.
+ */
+void Threads::growStack(ThreadInfo *tp)
+{
+  uint8_t *old = tp->stack;
+  uint8_t *old_top = old + tp->stack_size;
+  uint8_t *grow = tp->grow_stack;
+  int grow_size = tp->grow_size;
+  if (tp->grow_mode == GROW_RESTART) {
+    tp->sp = loadstack(tp->func, tp->arg, grow, grow_size);
+    tp->save.lr = 0xFFFFFFF9;
+  }
+  else {
+    uint8_t *sp = (uint8_t*)tp->sp;
+    int used = old_top - sp;
+    uint8_t *new_top = grow + grow_size;
+    new_top -= (uint32_t)(new_top - old_top) & 7;
+    int32_t delta = new_top - old_top;
+    memcpy(new_top - used, sp, used);
+    for (uint32_t *w = (uint32_t*)(new_top - used); w < (uint32_t*)new_top; w++) {
+      if (*w >= (uint32_t)sp && *w <= (uint32_t)old_top) *w += delta;
+    }
+    uint32_t *r = &tp->save.r4;
+    for (int i=0; i<8; i++) {  // r4-r11
+      if (r[i] >= (uint32_t)sp && r[i] <= (uint32_t)old_top) r[i] += delta;
+    }
+    tp->sp = sp + delta;
+  }
+  tp->retired_stack = tp->my_stack ? old : 0;
+  tp->retired_place = tp->stack_place;
+  tp->stack_place = PLACE_OCRAM;
+  tp->stack = grow;
+  tp->stack_size = grow_size;
+  tp->my_stack = 1;
+  tp->grow_stack = 0;
+  tp->grow_mode = GROW_NONE;
+  tp->grow_count++;
+}
+
+/*
+ * Users call this function to see if stack has been corrupted
+ */
+int Threads::testStackMarkers(int *threadid)
+{
+  for (int i=0; i < MAX_THREADS; i++) {
+    if (threadp[i] == NULL) continue;
+    if (threadp[i]->flags == RUNNING) {
+      uint32_t *m = (uint32_t*)threadp[i]->stack;
+      if (*m != thread_marker) {
+        if (threadid) *threadid = i;
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Initializes a thread's stack. Called when thread is created
+ */
+void *Threads::loadstack(ThreadFunction p, void * arg, void *stackaddr, int stack_size)
+{
+  interrupt_stack_t * process_frame = (interrupt_stack_t *)((uint8_t*)stackaddr + stack_size - sizeof(interrupt_stack_t) - overflow_stack_size);
+  process_frame->r0 = (uint32_t)arg;
+  process_frame->r1 = 0;
+  process_frame->r2 = 0;
+  process_frame->r3 = 0;
+  process_frame->r12 = 0;
+  process_frame->lr = (uint32_t)Threads::del_process;
+  process_frame->pc = ((uint32_t)p);
+  process_frame->xpsr = 0x1000000;
+  uint8_t *ret = (uint8_t*)process_frame;
+  // ret -= sizeof(software_stack_t); // uncomment this if we are saving R4-R11 to the stack
+  return (void*)ret;
+}
+
+/*
+ * Add a new thread to the queue.
+ *    add_thread(fund, arg)
+ *
+ *    fund : is a function pointer. The function prototype is:
+ *           void *func(void *param)
+ *    arg  : is a void pointer that is passed as the first parameter
+ *           of the function. In the example above, arg is passed
+ *           as param.
+ *    stack_size : the size of the buffer pointed to by stack. If
+ *           it is 0, then "stack" must also be 0. If so, the function
+ *           will allocate the default stack size of the heap using new().
+ *    stack : pointer to new data stack of size stack_size. If this is 0,
+ *           then it will allocate a stack on the heap using new() of size
+ *           stack_size. If stack_size is 0, a default size will be used.
+ *    return: an integer ID to be used for other calls
+ */
+/*
+ * "layout" is sizeof(StaticThread) as seen where the call was compiled. It
+ * differs from ours if that file was built with other THREADS_ settings, and
+ * then inline code there reads ThreadInfo at the wrong offsets. That is a
+ * build error, so stop here rather than corrupt memory later.
+ */
+static void check_layout(int layout)
+{
+  if (layout != (int)sizeof(Threads::StaticThread)) __builtin_trap();
+}
+
+int Threads::addThread(ThreadFunction p, void * arg, int stack_size, void *stack, int arena_size, int layout)
+{
+  check_layout(layout);
+  // Take the heap lock before locking the scheduler: once locked, we could
+  // never get it from a thread that was switched out in the middle of malloc().
+  heap_lock(malloc_mutex);
+  lockScheduler();
+  stack_size = stackClassSize(stack_size);
   for (int i=1; i < MAX_THREADS; i++) {
     if (threadp[i] == NULL) { // empty thread, so fill it
-      threadp[i] = new ThreadInfo();
+      void *info = NULL;
+#ifdef __IMXRT1062__
+      if (default_placement == PLACE_DTCM) info = pool_alloc(sizeof(ThreadInfo));
+#endif
+      threadp[i] = info ? new (info) ThreadInfo() : new ThreadInfo();
     }
     if (threadp[i]->flags == ENDED || threadp[i]->flags == EMPTY) { // free thread
       ThreadInfo *tp = threadp[i]; // working on this thread
       if (tp->stack && tp->my_stack) {
-        delete[] tp->stack;
+        place_free(tp->stack, tp->stack_place);
+      }
+      if (tp->arena && tp->my_arena) {
+        delete[] tp->arena;
+      }
+      if (tp->grow_stack) {
+        delete[] tp->grow_stack;
+        tp->grow_stack = 0;
       }
+      if (tp->retired_stack) {
+        place_free(tp->retired_stack, tp->retired_place);
+        tp->retired_stack = 0;
+      }
+      tp->grow_mode = GROW_NONE;
+      tp->grow_count = 0;
+      if (tp->periodic) {
+        delete tp->periodic;
+        tp->periodic = 0;
+        periodic_count--;
+        updateTickCheck();
+      }
+      if (tp->budget_ticks) {
+        tp->budget_ticks = 0;
+        budget_count--;
+        updateTickCheck();
+      }
+      // the arena sits above the top of a stack we allocate, out of the way
+      // of an overflow, and is freed with it
+      int arena_offset = (stack_size + 7) & ~7;
+      tp->arena = 0;
+      tp->my_arena = 0;
       if (stack==0) {
-        stack = new uint8_t[stack_size];
+        stack = placeAlloc(arena_size ? arena_offset + arena_size : stack_size, &tp->stack_place);
         tp->my_stack = 1;
+        if (arena_size) tp->arena = (uint8_t*)stack + arena_offset;
       }
       else {
         tp->my_stack = 0;
+        tp->stack_place = PLACE_OCRAM;  // caller's memory; not ours to free
+        if (arena_size) {
+          tp->arena = new uint8_t[arena_size];
+          tp->my_arena = 1;
+        }
       }
+      tp->arena_size = tp->arena ? arena_size : 0;
+      tp->arena_used = 0;
+      tp->arena_new = 0;
+      memset(tp->tls, 0, sizeof(tp->tls));
+#if THREADS_TLS_SIZE
+      if (tp->tls_block == 0) tp->tls_block = new uint8_t[THREADS_TLS_SIZE];
+      tls_init(tp);
+#endif
+#if THREADS_NEWLIB_REENT
+      reent_init(tp);
+#endif
+      if (DEFAULT_STACK_PAINT) paintStack(stack, stack_size);
+      tp->stack_painted = DEFAULT_STACK_PAINT;
       setStackMarker(stack);
       tp->stack = (uint8_t*)stack;
       tp->stack_size = stack_size;
+      tp->func = p;
+      tp->arg = arg;
       void *psp = loadstack(p, arg, tp->stack, tp->stack_size);
       tp->sp = psp;
       tp->ticks = DEFAULT_TICKS;
       tp->flags = RUNNING;
+      markReady(i);
       tp->save.lr = 0xFFFFFFF9;
 
 #ifdef DEBUG
@@ -577,27 +1653,213 @@ int Threads::addThread(ThreadFunction p, void * arg, int stack_size, void *stack
       tp->cyclesAccum = 0;
 #endif
 
-      currentActive = old_state;
-      thread_count++;
-      if (old_state == STARTED || old_state == FIRST_RUN) start();
-      return i;
+      thread_count++;
+      if (currentActive == FIRST_RUN) start(); // the first thread starts threading
+      unlockScheduler();
+      malloc_mutex.unlock();
+      return i;
+    }
+  }
+  unlockScheduler();
+  malloc_mutex.unlock();
+  return -1;
+}
+
+Threads::StaticThread::StaticThread(ThreadFunction func, void *arg, void *stack, int stack_size, int ticks, int autostart, int layout)
+  : func(func), arg(arg), stack((uint8_t*)stack), stack_size(stack_size),
+    ticks(ticks), autostart(autostart), thread_id(-1), next(0)
+{
+  check_layout(layout);
+  if (static_ready) {
+    threads.addStaticThread(this);
+  }
+  else {
+    // keep the order of definition, so ids are predictable
+    StaticThread **p = &static_pending;
+    while (*p) p = &(*p)->next;
+    *p = this;
+  }
+}
+
+/*
+ * Give a StaticThread a slot. Like addThread(), but all memory comes from
+ * the StaticThread, and threading isn't started here because this usually
+ * runs before setup().
+ */
+int Threads::addStaticThread(StaticThread *st)
+{
+  lockScheduler();
+  for (int i=1; i < MAX_THREADS; i++) {
+    if (threadp[i] != NULL) continue;
+    ThreadInfo *tp = &st->info;
+    threadp[i] = tp;
+    tp->my_stack = 0;
+    tp->stack_place = PLACE_OCRAM;  // not ours to free
+#if THREADS_TLS_SIZE
+    tp->tls_block = st->tls_block;
+    tls_init(tp);
+#endif
+#if THREADS_NEWLIB_REENT
+    tp->reent = &st->reent;
+    _REENT_INIT_PTR(tp->reent);
+#endif
+    if (DEFAULT_STACK_PAINT) paintStack(st->stack, st->stack_size);
+    tp->stack_painted = DEFAULT_STACK_PAINT;
+    setStackMarker(st->stack);
+    tp->stack = st->stack;
+    tp->stack_size = st->stack_size;
+    tp->func = st->func;
+    tp->arg = st->arg;
+    tp->sp = loadstack(tp->func, tp->arg, tp->stack, tp->stack_size);
+    tp->ticks = st->ticks > 0 ? st->ticks - 1 : DEFAULT_TICKS; // as setTimeSlice()
+    tp->save.lr = 0xFFFFFFF9;
+
+#ifdef DEBUG
+    tp->cyclesStart = ARM_DWT_CYCCNT;
+    tp->cyclesAccum = 0;
+#endif
+
+    thread_count++;
+    st->thread_id = i;
+    if (st->autostart) {
+      tp->flags = RUNNING;
+      markReady(i);
+    }
+    else {
+      tp->flags = SUSPENDED;
+    }
+    unlockScheduler();
+    return i;
+  }
+  unlockScheduler();
+  return -1;
+}
+
+int Threads::getArenaUsed(int id) {
+  if (id < 0 || id >= MAX_THREADS || threadp[id] == NULL || threadp[id]->arena == 0) return -1;
+  return threadp[id]->arena_used;
+}
+
+int Threads::inArena(void *ptr) {
+  for (int i=1; i<MAX_THREADS; i++) {
+    ThreadInfo *tp = threadp[i];
+    if (tp && tp->arena && (uint8_t*)ptr >= tp->arena && (uint8_t*)ptr < tp->arena + tp->arena_size) return i;
+  }
+  return -1;
+}
+
+int Threads::setArenaNew(bool enable) {
+#ifdef THREADS_ARENA_NEW
+  if (currentThread->arena == 0) return 0;
+  currentThread->arena_new = enable;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+int Threads::allocTLS() {
+  __disable_irq();
+  int slot = (tls_count < THREADS_TLS_SLOTS) ? tls_count++ : -1;
+  __enable_irq();
+  return slot;
+}
+
+/*
+ * periodic_process() - Body of every periodic thread
+ *
+ * Waits (off the run list) for tick() to release a job, then calls the
+ * user function once and records its timing.
+ */
+void Threads::periodic_process(void *arg)
+{
+  ThreadPeriodic *pp = (ThreadPeriodic *)arg;
+  while (1) {
+    __disable_irq();
+    if (pp->pending == 0) {
+      threads.threadp[threads.current_thread]->flags = WAITING;
+      __enable_irq();
+      yield();
+      continue;
     }
+    pp->pending--;
+    __enable_irq();
+    uint32_t start = micros();
+    if (start - pp->job_us > pp->max_jitter_us) pp->max_jitter_us = start - pp->job_us;
+    (*pp->func)(pp->arg);
+    uint32_t end = micros();
+    uint32_t response = end - pp->job_us;
+    if (response > pp->max_response_us) pp->max_response_us = response;
+    if (response > pp->deadline_us) pp->misses++;
+    if (pp->budget_us && end - start > pp->budget_us) pp->overruns++;
+    pp->jobs++;
+    pp->job_us += pp->period_us;
   }
-  if (old_state == STARTED) start();
-  return -1;
 }
 
-int Threads::getState(int id)
+/*
+ * Add a periodic thread. The first job is released on the next tick.
+ * Release times are checked on every tick, so the tick (see setMicroTimer())
+ * should be well below the shortest period.
+ */
+int Threads::addPeriodicThread(ThreadFunction p, void *arg, unsigned int period_us,
+  unsigned int deadline_us, unsigned int budget_us, int stack_size, void *stack)
+{
+  if (period_us == 0) return -1;
+  ThreadPeriodic *pp = new ThreadPeriodic();
+  pp->func = p;
+  pp->arg = arg;
+  pp->period_us = period_us;
+  pp->deadline_us = deadline_us ? deadline_us : period_us;
+  pp->budget_us = budget_us;
+  pp->release_us = micros();
+  pp->job_us = pp->release_us;
+  int id = addThread(periodic_process, pp, stack_size, stack);
+  if (id < 0) {
+    delete pp;
+    return -1;
+  }
+  __disable_irq();
+  threadp[id]->periodic = pp;
+  periodic_count++;
+  updateTickCheck();
+  __enable_irq();
+  return id;
+}
+
+void Threads::setPeriodicPolicy(int policy)
 {
-  return threadp[id]->flags;
+  periodic_policy = policy;
+}
+
+const ThreadPeriodic *Threads::getPeriodic(int id)
+{
+  return threadp[id]->periodic;
 }
 
 int Threads::setState(int id, int state)
 {
-  threadp[id]->flags = state;
+  __atomic_store_n(&threadp[id]->flags, state, __ATOMIC_RELEASE);
+  if (state == RUNNING) markReady(id);
   return state;
 }
 
+/*
+ * Move a thread to "state" if it is in one of from_states (a mask of 1<<state)
+ * with a compare-and-swap, so a change made meanwhile by another thread or an
+ * interrupt (which clears the exclusive monitor) is never overwritten.
+ */
+int Threads::changeState(int id, uint32_t from_states, int state)
+{
+  volatile int *flags = &threadp[id]->flags;
+  int old = __atomic_load_n(flags, __ATOMIC_RELAXED);
+  do {
+    if (((1 << old) & from_states) == 0) return -1;
+  } while (! __atomic_compare_exchange_n(flags, &old, state, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (state == RUNNING) markReady(id);
+  return id;
+}
+
 int Threads::wait(int id, unsigned int timeout_ms)
 {
   unsigned int start = millis();
@@ -607,7 +1869,7 @@ int Threads::wait(int id, unsigned int timeout_ms)
   while (1) {
     if (timeout_ms != 0 && millis() - start > timeout_ms) return -1;
     state = threadp[id]->flags;
-    if (state != RUNNING) break;
+    if (state == ENDED || state == EMPTY) break; // not just blocked (WAITING, THROTTLED...)
     yield();
   }
   return id;
@@ -615,20 +1877,17 @@ int Threads::wait(int id, unsigned int timeout_ms)
 
 int Threads::kill(int id)
 {
-  threadp[id]->flags = ENDED;
-  return id;
+  return changeState(id, ~(1 << EMPTY), ENDED);
 }
 
 int Threads::suspend(int id)
 {
-  threadp[id]->flags = SUSPENDED;
-  return id;
+  return changeState(id, (1 << RUNNING) | (1 << SUSPENDED) | (1 << WAITING) | (1 << THROTTLED), SUSPENDED);
 }
 
 int Threads::restart(int id)
 {
-  threadp[id]->flags = RUNNING;
-  return id;
+  return changeState(id, (1 << SUSPENDED) | (1 << WAITING) | (1 << RUNNING), RUNNING);
 }
 
 void Threads::setTimeSlice(int id, unsigned int ticks)
@@ -636,6 +1895,42 @@ void Threads::setTimeSlice(int id, unsigned int ticks)
   threadp[id]->ticks = ticks - 1;
 }
 
+/*
+ * Budgets are replenished in fixed windows of period_ticks, so a thread
+ * gets at most budget_ticks of each window no matter how often it runs.
+ */
+int Threads::setBudget(int id, unsigned int budget_ticks, unsigned int period_ticks)
+{
+  if (id <= 0 || id >= MAX_THREADS || threadp[id] == NULL) return -1; // thread 0 always runs
+  if (budget_ticks && period_ticks < budget_ticks) return -1;
+  ThreadInfo *tp = threadp[id];
+  __disable_irq();
+  if (tp->budget_ticks == 0 && budget_ticks) budget_count++;
+  if (tp->budget_ticks && budget_ticks == 0) budget_count--;
+  tp->budget_ticks = budget_ticks;
+  tp->budget_period = period_ticks;
+  tp->budget_window = period_ticks;
+  tp->budget_used = 0;
+  tp->budget_overruns = 0;
+  if (tp->flags == THROTTLED) {
+    tp->flags = RUNNING;
+    markReady(id);
+  }
+  updateTickCheck();
+  __enable_irq();
+  return id;
+}
+
+void Threads::setBudgetCallback(ThreadFunctionInt callback)
+{
+  budget_callback = callback;
+}
+
+int Threads::getBudgetOverruns(int id)
+{
+  return threadp[id]->budget_overruns;
+}
+
 void Threads::setDefaultTimeSlice(unsigned int ticks)
 {
   DEFAULT_TICKS = ticks - 1;
@@ -646,12 +1941,9 @@ void Threads::setDefaultStackSize(unsigned int bytes_size)
   DEFAULT_STACK_SIZE = bytes_size;
 }
 
-void Threads::yield() {
-  __asm volatile("svc %0" : : "i"(Threads::SVC_NUMBER));
-}
-
-void Threads::yield_and_start() {
-  __asm volatile("svc %0" : : "i"(Threads::SVC_NUMBER_ACTIVE));
+void Threads::setDefaultStackPaint(bool enable)
+{
+  DEFAULT_STACK_PAINT = enable;
 }
 
 void Threads::delay(int millisecond) {
@@ -668,9 +1960,18 @@ void Threads::setSleepCallback(ThreadFunctionSleep callback)
   enter_sleep_callback = callback;
 }
 
+/*
+ * Longer waits block on the wake timer so the thread is off the run list
+ * and resumes right on time; short ones (and thread 0) keep yielding.
+ */
 void Threads::delay_us(int microsecond){
-  int mx = micros();
-  while ((int)micros() - mx < microsecond) yield();
+  uint32_t wake = micros() + microsecond;
+  if (microsecond >= DELAY_US_BLOCK) {
+    while ((int32_t)(micros() - wake) < 0) {
+      if (! sleepUntil(wake)) break;
+    }
+  }
+  while ((int32_t)(micros() - wake) < 0) yield();
 }
 
 void Threads::idle() {
@@ -743,14 +2044,6 @@ void Threads::sleep(int ms) {
 
 /* End of experimental code */
 
-int Threads::id() {
-  volatile int ret;
-  __disable_irq();
-  ret = current_thread;
-  __enable_irq();
-  return ret;
-}
-
 int Threads::getStackUsed(int id) {
   return threadp[id]->stack + threadp[id]->stack_size - (uint8_t*)threadp[id]->sp;
 }
@@ -759,29 +2052,51 @@ int Threads::getStackRemaining(int id) {
   return (uint8_t*)threadp[id]->sp - threadp[id]->stack;
 }
 
+/*
+ * Append to the threadsInfo() buffer, truncating once it is full
+ */
+static void info_append(char *buffer, size_t size, size_t &cursor, const char *format, ...)
+{
+  if (cursor + 1 >= size) return;
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer + cursor, size - cursor, format, args);
+  va_end(args);
+  if (n < 0) return;
+  cursor += n;
+  if (cursor + 1 > size) cursor = size - 1;
+}
+
 char *Threads::threadsInfo(void)
 {
   static char _buffer[Threads::UTIL_TRHEADS_BUFFER_LENGTH];
-  unsigned int _buffer_cursor = 0;
-  _buffer_cursor = sprintf(_buffer, "_____\n");
+  const size_t size = sizeof(_buffer);
+  size_t _buffer_cursor = 0;
+  _buffer[0] = 0;
+  info_append(_buffer, size, _buffer_cursor, "_____\n");
   for (int each_thread = 0; each_thread < thread_count; each_thread++)
   {
     if (threadp[each_thread] != NULL)
     {
-      _buffer_cursor += sprintf(_buffer + _buffer_cursor, "%d:", each_thread);
-      _buffer_cursor += sprintf(_buffer + _buffer_cursor, "Stack size:%d|",
-                                threadp[each_thread]->stack_size);
-      _buffer_cursor += sprintf(_buffer + _buffer_cursor, "Used:%d|Remains:%d|",
-                                getStackUsed(each_thread),
-                                getStackRemaining(each_thread));
+      info_append(_buffer, size, _buffer_cursor, "%d:", each_thread);
+      info_append(_buffer, size, _buffer_cursor, "Stack size:%d|",
+                  threadp[each_thread]->stack_size);
+      info_append(_buffer, size, _buffer_cursor, "Used:%d|Remains:%d|",
+                  getStackUsed(each_thread),
+                  getStackRemaining(each_thread));
+      if (threadp[each_thread]->stack_painted) {
+        info_append(_buffer, size, _buffer_cursor, "Max:%d|Suggest:%d|",
+                    getStackHighWater(each_thread),
+                    getStackSuggested(each_thread));
+      }
       char *_thread_state = _util_state_2_string(threadp[each_thread]->flags);
-      _buffer_cursor += sprintf(_buffer + _buffer_cursor, "State:%s|",
-                                _thread_state);
+      info_append(_buffer, size, _buffer_cursor, "State:%s|",
+                  _thread_state);
 #ifdef DEBUG
-      _buffer_cursor += sprintf(_buffer + _buffer_cursor, "cycles:%lu\n",
-                                threadp[each_thread]->cyclesAccum);
+      info_append(_buffer, size, _buffer_cursor, "cycles:%lu\n",
+                  threadp[each_thread]->cyclesAccum);
 #else
-      _buffer_cursor += sprintf(_buffer + _buffer_cursor, "\n");
+      info_append(_buffer, size, _buffer_cursor, "\n");
 #endif
     }
   }
@@ -790,83 +2105,553 @@ char *Threads::threadsInfo(void)
 
 #ifdef DEBUG
 unsigned long Threads::getCyclesUsed(int id) {
-  stop();
-  unsigned long ret = threadp[id]->cyclesAccum;
-  start();
-  return ret;
+  return threadp[id]->cyclesAccum;  // a single word; nothing to lock
 }
 #endif
 
+int Threads::Mutex::lock(unsigned int timeout_ms) {
+  // micros() wraps after about 71 minutes, so cap longer timeouts there
+  if (timeout_ms > 4000000) timeout_ms = 4000000;
+  return lock_us(timeout_ms * 1000);
+}
+
+int __attribute__ ((noinline)) Threads::Mutex::lock_us(unsigned int timeout_us) {
+  if (try_lock()) return 1; // we're good, so avoid more checks
+
+  uint32_t deadline = micros() + timeout_us;
+  // a waiter with a timeout needs the wake timer to get back on the run list
+  int can_wait = (timeout_us == 0 || wake_timer_begin());
+  while (1) {
+    if (try_lock()) return 1;
+    if (timeout_us && (int32_t)(micros() - deadline) >= 0) {
+      __disable_irq();
+      if (waitthread == threads.current_thread) waitthread = -1;
+      __enable_irq();
+      return 0;
+    }
+    if (waitthread==-1 && can_wait) { // can hold 1 thread waiting until unlock
+      threads.lockScheduler();
+      if (state == 0) { // unlocked since try_lock(), so nobody would wake us
+        threads.unlockScheduler();
+        continue;
+      }
+      waitthread = threads.current_thread;
+      waitcount = currentCount;
+      if (waitthread) {
+        __disable_irq();
+        ThreadInfo *tp = threads.threadp[waitthread];
+        tp->flags = WAITING;
+        if (timeout_us) threads.setWake(tp, deadline);
+        __enable_irq();
+      }
+      threads.unlockScheduler();
+    }
+    threads.yield();
+  }
+  __flush_cpu();
+  return 0;
+}
+
 /*
- * On creation, stop threading and save state
+ * Event
  */
-Threads::Suspend::Suspend() {
-  __disable_irq();
-  save_state = currentActive;
-  currentActive = 0;
-  __enable_irq();
+
+int Threads::Event::wait(unsigned int timeout_us) {
+  uint32_t deadline = micros() + timeout_us;
+  // the wake timer also lets signal() from an interrupt switch right away
+  int can_wait = wake_timer_begin() || timeout_us == 0;
+  while (1) {
+    __disable_irq();
+    int id = threads.current_thread;
+    if (flag) {
+      flag = 0;
+      // a timeout still armed would wake a later, unrelated wait
+      threads.threadp[id]->wake_set = 0;
+      __enable_irq();
+      return 1;
+    }
+    if (timeout_us && (int32_t)(micros() - deadline) >= 0) {
+      waiters &= ~(1 << id);
+      threads.threadp[id]->wake_set = 0;
+      __enable_irq();
+      return 0;
+    }
+    if (! can_wait) {
+      __enable_irq();
+      threads.yield();
+      continue;
+    }
+    if (timeout_us && id) threads.setWake(threads.threadp[id], deadline);
+    threads.waitOn(waiters);
+  }
+}
+
+void Threads::Event::signal() {
+  uint32_t ipsr, primask;
+  __asm__ volatile("mrs %0, ipsr" : "=r" (ipsr));
+  __asm__ volatile("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+  flag = 1;
+  int woken = waiters ? threads.wakeAll(waiters) : 0;
+  if (woken && ipsr) wake_timer_pend();
+  __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+  if (woken && ! ipsr && ! primask) threads.yield();
 }
 
 /*
- * On destruction, restore threading state
+ * Timer
  */
-Threads::Suspend::~Suspend() {
-  __disable_irq();
-  currentActive = save_state;
-  __enable_irq();
+
+Threads::Timer *Threads::Timer::head = 0;
+Threads::Event Threads::Timer::changed;
+int Threads::Timer::daemon_id = -1;
+
+int Threads::Timer::begin(int stack_size, int slice_ticks) {
+  if (daemon_id <= 0) daemon_id = threads.addThread(run, 0, stack_size);
+  if (daemon_id > 0 && slice_ticks > 0) threads.setTimeSlice(daemon_id, slice_ticks);
+  return daemon_id;
 }
 
-int Threads::Mutex::getState() {
-  int p = threads.stop();
-  int ret = state;
-  threads.start(p);
-  return ret;
+// Both of these are called with interrupts disabled
+void Threads::Timer::insert() {
+  Timer **p = &head;
+  while (*p && (int32_t)((*p)->expires - expires) <= 0) p = &(*p)->next;
+  next = *p;
+  *p = this;
+  active = 1;
 }
 
-int __attribute__ ((noinline)) Threads::Mutex::lock(unsigned int timeout_ms) {
-  if (try_lock()) return 1; // we're good, so avoid more checks
+void Threads::Timer::unlink() {
+  if (! active) return;
+  for (Timer **p = &head; *p; p = &(*p)->next) {
+    if (*p == this) {
+      *p = next;
+      break;
+    }
+  }
+  active = 0;
+}
+
+void Threads::Timer::start(uint32_t delay_us, uint32_t period_us) {
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+  unlink();
+  this->delay_us = delay_us;
+  this->period_us = period_us;
+  expires = micros() + delay_us;
+  insert();
+  int first = (head == this);
+  __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+  if (first) changed.signal(); // the daemon must wake earlier
+}
+
+void Threads::Timer::stop() {
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask\n cpsid i" : "=r" (primask) :: "memory");
+  unlink();
+  __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+}
 
-  uint32_t start = systick_millis_count;
+/*
+ * The daemon: run due callbacks, then sleep until the first timer expires
+ * or start() puts an earlier one in front. Periodic timers keep their
+ * phase, but skip periods missed because a callback ran long.
+ */
+void Threads::Timer::run(void *) {
   while (1) {
-    if (try_lock()) return 1;
-    if (timeout_ms && (systick_millis_count - start > timeout_ms)) return 0;
-    if (waitthread==-1) { // can hold 1 thread suspend until unlock
-      int p = threads.stop();
-      waitthread = threads.current_thread;
-      waitcount = currentCount;
-      threads.suspend(waitthread);
-      threads.start(p);
+    __disable_irq();
+    uint32_t now = micros();
+    Timer *t = head;
+    if (t && (int32_t)(now - t->expires) >= 0) {
+      head = t->next;
+      t->active = 0;
+      if (t->period_us) {
+        t->expires += t->period_us;
+        if ((int32_t)(now - t->expires) >= 0) t->expires = now + t->period_us;
+        t->insert();
+      }
+      Callback callback = t->callback;
+      void *callback_arg = t->arg;
+      __enable_irq();
+      callback(callback_arg);
+      continue;
     }
-    threads.yield();
+    uint32_t wait_us = t ? t->expires - now : 0;  // 0 waits for start()
+    __enable_irq();
+    changed.wait(wait_us);
   }
-  __flush_cpu();
-  return 0;
 }
 
-int Threads::Mutex::try_lock() {
-  int p = threads.stop();
-  if (state == 0) {
-    state = 1;
-    threads.start(p);
-    return 1;
+/*
+ * WorkQueue
+ */
+
+int Threads::WorkQueue::begin(int stack_size) {
+  return threads.addThread(run, this, stack_size);
+}
+
+int Threads::WorkQueue::post(Work &work) {
+  int expected = 0;
+  if (! __atomic_compare_exchange_n(&work.pending, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 0;
   }
-  threads.start(p);
-  return 0;
+  Work *old = head;
+  do {
+    work.next = old;
+  } while (! __atomic_compare_exchange_n(&head, &old, &work, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (old == NULL) posted.signal(); // the worker may be waiting
+  return 1;
+}
+
+/*
+ * The worker takes all posted items with one exchange and reverses them to
+ * run them in the order posted. An item is no longer pending when its
+ * function is called, so it can be posted again meanwhile.
+ */
+void Threads::WorkQueue::run(void *arg) {
+  WorkQueue *q = (WorkQueue*)arg;
+  while (1) {
+    Work *list = __atomic_exchange_n(&q->head, (Work*)NULL, __ATOMIC_ACQUIRE);
+    if (list == NULL) {
+      q->posted.wait();
+      continue;
+    }
+    Work *fifo = NULL;
+    while (list) {
+      Work *next = list->next;
+      list->next = fifo;
+      fifo = list;
+      list = next;
+    }
+    while (fifo) {
+      Work *w = fifo;
+      fifo = w->next;
+      __atomic_store_n(&w->pending, 0, __ATOMIC_RELEASE);
+      w->func(w->arg);
+    }
+  }
+}
+
+/*
+ * Uncontended locking is a single LDREX/STREX compare-and-swap, without
+ * stopping threads or disabling interrupts.
+ */
+int Threads::Mutex::try_lock() {
+  int expected = 0;
+  return __atomic_compare_exchange_n(&state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
 int __attribute__ ((noinline)) Threads::Mutex::unlock() {
-  int p = threads.stop();
+  threads.lockScheduler();
   if (state==1) {
     state = 0;
     if (waitthread >= 0) { // reanimate a suspended thread waiting for unlock
-      threads.restart(waitthread);
+      // not if suspended meanwhile; otherwise hand it the CPU once the
+      // scheduler is unlocked
+      if (threads.changeState(waitthread, 1 << WAITING, RUNNING) >= 0) threads.handoffTo(waitthread);
       waitthread = -1;
-      __flush_cpu();
-      threads.yield_and_start();
-      return 1;
+      currentDeferred = 1;
     }
   }
   __flush_cpu();
-  threads.start(p);
+  threads.unlockScheduler();
+  return 1;
+}
+
+int Threads::RecursiveMutex::lock(unsigned int timeout_ms) {
+  int me = threads.id();
+  if (owner == me) {
+    count++;
+    return 1;
+  }
+  if (! m.lock(timeout_ms)) return 0;
+  owner = me;
+  count = 1;
+  return 1;
+}
+
+int Threads::RecursiveMutex::try_lock() {
+  int me = threads.id();
+  if (owner == me) {
+    count++;
+    return 1;
+  }
+  if (! m.try_lock()) return 0;
+  owner = me;
+  count = 1;
+  return 1;
+}
+
+int Threads::RecursiveMutex::unlock() {
+  if (owner != threads.id()) return 0;
+  if (--count == 0) {
+    owner = -1;
+    m.unlock();
+  }
+  return 1;
+}
+
+int Threads::RWLock::try_lock_shared() {
+  uint32_t s = state;
+  while ((s & WRITER) == 0 && writers_waiting == 0) {
+    if (__atomic_compare_exchange_n(&state, &s, s + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 1;
+  }
+  return 0;
+}
+
+void Threads::RWLock::lock_shared() {
+  while (! try_lock_shared()) {
+    __disable_irq();
+    if ((state & WRITER) || writers_waiting) threads.waitOn(waiters);
+    else __enable_irq();
+  }
+}
+
+void Threads::RWLock::unlock_shared() {
+  if (__atomic_sub_fetch(&state, 1, __ATOMIC_RELEASE) == 0 && waiters) {
+    __disable_irq();
+    threads.wakeAll(waiters);
+    __enable_irq();
+    threads.yield();  // hand over to the woken writer
+  }
+}
+
+int Threads::RWLock::try_lock() {
+  uint32_t s = 0;
+  return __atomic_compare_exchange_n(&state, &s, WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void Threads::RWLock::lock() {
+  if (try_lock()) return;
+  __atomic_add_fetch(&writers_waiting, 1, __ATOMIC_RELAXED);
+  while (! try_lock()) {
+    __disable_irq();
+    if (state != 0) threads.waitOn(waiters);
+    else __enable_irq();
+  }
+  __atomic_sub_fetch(&writers_waiting, 1, __ATOMIC_RELAXED);
+}
+
+void Threads::RWLock::unlock() {
+  __atomic_store_n(&state, 0, __ATOMIC_RELEASE);
+  if (waiters) {
+    __disable_irq();
+    threads.wakeAll(waiters);
+    __enable_irq();
+    threads.yield();  // hand over to a woken waiter
+  }
+}
+
+Threads::AsyncPrint::AsyncPrint(Print &output, int ring_size, int line_size) {
+  out = &output;
+  this->ring_size = 64;
+  while ((int)this->ring_size < ring_size) this->ring_size <<= 1;
+  if (line_size > 255) line_size = 255;
+  this->line_size = line_size;
+  memset(line_len, 0, sizeof(line_len));
+}
+
+int Threads::AsyncPrint::begin(int stack_size) {
+  if (ring == 0) {
+    ring = new uint8_t[ring_size];
+    lines = new uint8_t[MAX_THREADS * line_size];
+    memset(ring, 0, ring_size);
+  }
+  int id = threads.addThread(drain, this, stack_size);
+  if (id > 0) threads.setTimeSlice(id, 1); // low priority: short slices
+  return id;
+}
+
+/*
+ * Claim space in the ring with a compare-and-swap, copy the line, then set
+ * the record's READY byte. A record is [length][READY][data...], and the
+ * drain thread zeroes what it consumes, so a claimed record isn't READY
+ * until its writer is done with it.
+ */
+void Threads::AsyncPrint::commit(const uint8_t *line, int len) {
+  const uint32_t mask = ring_size - 1;
+  uint32_t need = len + 2;
+  uint32_t h = head;
+  do {
+    if (need > ring_size - (h - tail)) {
+      dropped++;
+      return;
+    }
+  } while (! __atomic_compare_exchange_n(&head, &h, h + need, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  for (int i=0; i<len; i++) ring[(h + 2 + i) & mask] = line[i];
+  ring[h & mask] = len;
+  __flush_cpu();
+  ring[(h + 1) & mask] = READY;
+}
+
+size_t Threads::AsyncPrint::write(uint8_t c) {
+  if (lines == 0) return out->write(c);
+  int id = threads.id();
+  uint8_t *line = lines + id * line_size;
+  line[line_len[id]++] = c;
+  if (c == '\n' || line_len[id] == line_size) {
+    commit(line, line_len[id]);
+    line_len[id] = 0;
+  }
   return 1;
 }
+
+size_t Threads::AsyncPrint::write(const uint8_t *data, size_t size) {
+  for (size_t i=0; i<size; i++) write(data[i]);
+  return size;
+}
+
+void Threads::AsyncPrint::flush() {
+  if (lines == 0) return;
+  int id = threads.id();
+  if (line_len[id]) {
+    commit(lines + id * line_size, line_len[id]);
+    line_len[id] = 0;
+  }
+}
+
+/*
+ * Drain thread: copy as many complete records as fit into a local batch,
+ * write the batch in one call, and sleep when there is nothing to do.
+ */
+void Threads::AsyncPrint::drain(void *arg) {
+  AsyncPrint *p = (AsyncPrint *)arg;
+  const uint32_t mask = p->ring_size - 1;
+  uint8_t batch[256];
+  while (1) {
+    int n = 0;
+    while (p->tail != p->head) {
+      uint32_t t = p->tail;
+      if (p->ring[(t + 1) & mask] != READY) break; // writer still copying
+      int len = p->ring[t & mask];
+      if (n + len > (int)sizeof(batch)) break;
+      for (int i=0; i<len; i++) batch[n++] = p->ring[(t + 2 + i) & mask];
+      for (int i=0; i<len + 2; i++) p->ring[(t + i) & mask] = 0;
+      __flush_cpu();
+      p->tail = t + len + 2;
+    }
+    if (n) p->out->write(batch, n);
+    else threads.delay_us(DRAIN_POLL_US);
+  }
+}
+
+/*
+ * newlib calls these around malloc()/free() and getenv()/setenv(). Without
+ * them the heap is only safe across threads inside Threads::Suspend. They do
+ * nothing before the threads object exists (static constructors) and inside
+ * interrupts, which can't wait; don't allocate memory from interrupts.
+ */
+static inline int newlib_can_lock() {
+  uint32_t ipsr;
+  __asm__ volatile("mrs %0, ipsr" : "=r" (ipsr));
+  return currentThread && ipsr == 0;
+}
+
+extern "C" {
+  void __malloc_lock(struct _reent *r) {
+    if (newlib_can_lock()) heap_lock(malloc_mutex);
+  }
+  void __malloc_unlock(struct _reent *r) {
+    if (newlib_can_lock()) malloc_mutex.unlock();
+  }
+  void __env_lock(struct _reent *r) {
+    if (newlib_can_lock()) heap_lock(env_mutex);
+  }
+  void __env_unlock(struct _reent *r) {
+    if (newlib_can_lock()) env_mutex.unlock();
+  }
+}
+
+#ifdef THREADS_ARENA_NEW
+/*
+ * Global new/delete that use the arena of threads which called setArenaNew().
+ * These replace the ones in the Teensy core, so every variant is defined.
+ * Deleting an arena object does nothing; its memory comes back with
+ * arenaReset() or when the thread ends.
+ */
+static inline int in_interrupt() {
+  uint32_t ipsr;
+  __asm__ volatile("mrs %0, ipsr" : "=r" (ipsr));
+  return ipsr != 0;
+}
+
+void * operator new(size_t size) {
+  if (currentThread && currentThread->arena_new && ! in_interrupt()) {
+    void *p = Threads::arenaAlloc(size);
+    if (p) return p;
+  }
+  return malloc(size);
+}
+
+void * operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void * ptr) noexcept {
+  if (threads.inArena(ptr) < 0) free(ptr);
+}
+
+void operator delete[](void * ptr) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete(void * ptr, size_t size) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete[](void * ptr, size_t size) noexcept {
+  operator delete(ptr);
+}
+#endif
+
+#if defined(THREADS_CORE_YIELD) || defined(THREADS_WRAP_DELAY)
+/*
+ * Can the caller give up the CPU? Not from interrupts, nor with interrupts
+ * masked by PRIMASK or BASEPRI: the SVC would escalate to a HardFault.
+ */
+static inline int can_switch() {
+  uint32_t ipsr, primask, basepri;
+  __asm__ volatile("mrs %0, ipsr" : "=r" (ipsr));
+  __asm__ volatile("mrs %0, primask" : "=r" (primask));
+  __asm__ volatile("mrs %0, basepri" : "=r" (basepri));
+  return ipsr == 0 && primask == 0 && basepri == 0 && currentActive == Threads::STARTED;
+}
+#endif
+
+#ifdef THREADS_CORE_YIELD
+#include <EventResponder.h>
+/*
+ * Replace the core's weak yield(). The core's delay() and the wait loops of
+ * many libraries call it, so with this they give the rest of their slice
+ * to other threads instead of spinning. EventResponder callbacks are still
+ * run, but only from thread 0, so they never land on a small thread stack.
+ * serialEvent() functions are not called; poll from loop() instead.
+ */
+extern "C" void yield(void) {
+  if (threads.id() == 0) {
+    EventResponder::runFromYield();
+  }
+  if (can_switch()) Threads::yield();
+}
+#endif
+
+#ifdef THREADS_WRAP_DELAY
+/*
+ * The core's delay() isn't weak, so it is replaced at link time: build
+ * with -DTHREADS_WRAP_DELAY and link with -Wl,--wrap=delay. Threads other
+ * than thread 0 then sleep off the run list on the wake timer, like
+ * delay_us(). Thread 0, interrupts and code with interrupts disabled get
+ * the core's delay().
+ */
+extern "C" void __real_delay(uint32_t msec);
+extern "C" void __wrap_delay(uint32_t msec) {
+  if (threads.id() == 0 || ! can_switch()) {
+    __real_delay(msec);
+    return;
+  }
+  while (msec > 1000) {  // keep delay_us() within an int
+    threads.delay_us(1000000);
+    msec -= 1000;
+  }
+  threads.delay_us(msec * 1000);
+}
+#endif
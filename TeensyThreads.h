@@ -71,20 +71,56 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <Print.h>
 
 /* Enabling debugging information allows access to:
  *   getCyclesUsed()
  */
 // #define DEBUG
 
+// The THREADS_ settings below must be global build flags (-D), the same for
+// the library and every file that includes this one; a #define in a sketch
+// only reaches that sketch. Several change the size of ThreadInfo, so a
+// mismatch is caught by addThread() and StaticThread, which trap.
+
+// Thread-local storage: THREADS_TLS_SLOTS pointer slots per thread (see
+// Threads::allocTLS()), and THREADS_TLS_SIZE bytes per thread for variables
+// declared __thread or thread_local. The latter is off (0) by default.
+#ifndef THREADS_TLS_SLOTS
+#define THREADS_TLS_SLOTS 4
+#endif
+#ifndef THREADS_TLS_SIZE
+#define THREADS_TLS_SIZE 0
+#endif
+
+// Define THREADS_PSP_ONLY to run every thread, including setup()/loop(), on
+// the process stack (PSP) and keep the main stack (MSP) for interrupts only,
+// in a buffer of THREADS_MSP_SIZE bytes.
+#ifndef THREADS_MSP_SIZE
+#define THREADS_MSP_SIZE 2048
+#endif
+
+// Set THREADS_NEWLIB_REENT to 1 to give each thread its own newlib state
+// (errno, strtok(), stdio) by switching _impure_ptr with the thread. Costs
+// sizeof(struct _reent), about 1KB, per thread.
+#ifndef THREADS_NEWLIB_REENT
+#define THREADS_NEWLIB_REENT 0
+#endif
+
+#if THREADS_NEWLIB_REENT
+#include <reent.h>
+#endif
+
 extern "C" {
   void context_switch(void);
   void context_switch_direct(void);
   void context_switch_pit_isr(void);
   void loadNextThread();
   void stack_overflow_isr(void);
+  void threads_alloc_deadlock(void);
   void threads_svcall_isr(void);
   void threads_systick_isr(void);
+  int context_switch_tick(void);
 }
 
 // The stack frame saved by the interrupt
@@ -147,17 +183,63 @@ typedef struct {
 #endif
 } software_stack_t;
 
+typedef void (*ThreadFunction)(void*);
+
+// Timing and statistics of a periodic thread; see Threads::addPeriodicThread()
+class ThreadPeriodic {
+  public:
+    ThreadFunction func;
+    void *arg;
+    uint32_t period_us;
+    uint32_t deadline_us;       // relative to release
+    uint32_t budget_us;         // expected execution time per job; 0 if unknown
+    uint32_t release_us;        // next release, advanced by the scheduler tick
+    volatile int pending = 0;   // released jobs not yet started
+    uint32_t job_us;            // release time of the current (or next) job
+    unsigned long jobs = 0;     // jobs completed
+    unsigned long misses = 0;   // jobs that completed after their deadline
+    unsigned long overruns = 0; // jobs that executed longer than budget_us
+    uint32_t max_jitter_us = 0; // worst delay from release to job start
+    uint32_t max_response_us = 0; // worst delay from release to job end
+};
+
 // The state of each thread (including thread 0)
 class ThreadInfo {
   public:
     int stack_size;
     uint8_t *stack=0;
     int my_stack = 0;
+    int stack_painted = 0;
+    ThreadFunction func;     // entry point and argument, for GROW_RESTART
+    void *arg;
+    uint8_t *grow_stack = 0; // larger stack ready for setStackGrowth()
+    int grow_size;
+    int grow_mode = 0;
+    int grow_count = 0;
+    int stack_place = 0;     // where the stack was allocated; see Threads::PLACE_DTCM
+    uint8_t *retired_stack = 0; // stack replaced by growth, freed when the thread ends
+    int retired_place = 0;
     software_stack_t save;
     volatile int flags = 0;
     void *sp;
     int ticks;
     volatile int sleep_time_till_end_tick; // Per-task sleep time
+    ThreadPeriodic *periodic = 0;  // set for threads made by addPeriodicThread()
+    int budget_ticks = 0;    // ticks allowed per budget period; 0 for no budget
+    int budget_period = 0;   // length of the budget period in ticks
+    int budget_window;       // ticks left in the current budget period
+    int budget_used;         // ticks used in the current budget period
+    unsigned long budget_overruns;
+    uint32_t wake_us;        // when to wake from WAITING; see Threads::sleepUntil()
+    volatile int wake_set = 0;
+    void *tls[THREADS_TLS_SLOTS] = {};  // see Threads::getTLS()
+    uint8_t *tls_block = 0;  // __thread variables; THREADS_TLS_SIZE bytes
+    struct _reent *reent = 0;  // newlib state; see THREADS_NEWLIB_REENT
+    uint8_t *arena = 0;      // see Threads::arenaAlloc()
+    int arena_size = 0;
+    int arena_used = 0;
+    int my_arena = 0;        // arena allocated apart from the stack
+    int arena_new = 0;       // operator new uses the arena; see Threads::setArenaNew()
 #ifdef DEBUG
     unsigned long cyclesStart;  // On T_4 the CycCnt is always active - on T_3.x it currently is not - unless Audio starts it AFAIK
     unsigned long cyclesAccum;
@@ -165,8 +247,12 @@ class ThreadInfo {
 };
 
 extern "C" void unused_isr(void);
+extern "C" ThreadInfo *currentThread;
+extern "C" volatile int currentLock;      // see Threads::lockScheduler()
+extern "C" volatile int currentDeferred;  // a switch was due while locked
+extern "C" volatile uint32_t currentReadyMask; // bit per thread that may be RUNNING
+extern "C" uint32_t currentBit;               // bit of the current thread
 
-typedef void (*ThreadFunction)(void*);
 typedef void (*ThreadFunctionInt)(int);
 typedef void (*ThreadFunctionNone)();
 typedef int (*ThreadFunctionSleep)(int);
@@ -179,15 +265,43 @@ typedef void (*IsrFunction)();
  */
 class Threads {
 public:
+  class StaticThread;
   // The maximum number of threads is hard-coded to simplify
   // the implementation. See notes of ThreadInfo.
   int DEFAULT_TICKS = 10;
   int DEFAULT_STACK_SIZE = 1024;
+  int DEFAULT_STACK_PAINT = 0;
+  // Bytes for each stack size class; see STACK_SMALL
+  int STACK_SMALL_SIZE = 512;
+  int STACK_MEDIUM_SIZE = 2048;
+  int STACK_LARGE_SIZE = 8192;
   static const int MAX_THREADS = 16;
   static const int DEFAULT_STACK0_SIZE = 10240; // estimate for thread 0?
   static const int DEFAULT_TICK_MICROSECONDS = 100;
   static const int UTIL_STATE_NAME_DESCRIPTION_LENGTH = 24;
   static const int UTIL_TRHEADS_BUFFER_LENGTH = 1024;
+  static const uint32_t STACK_PAINT = 0xC5C5C5C5;
+  static const int STACK_SUGGEST_MARGIN = 64;
+  static const int STACK_GUARD_MIN = 64; // smallest stack above the guard worth guarding
+  static const int DELAY_US_BLOCK = 20; // delay_us() blocks on a timer at or above this
+  static const int STACK_GROW_MARGIN = 128; // grow a stack with less than this left
+
+  // Stack size classes: pass as stack_size to addThread() or setStackGrowth()
+  static const int STACK_DEFAULT = -1;
+  static const int STACK_SMALL = -2;
+  static const int STACK_MEDIUM = -3;
+  static const int STACK_LARGE = -4;
+
+  // Where addThread() puts new stacks and thread data. Only Teensy 4 has a
+  // choice; elsewhere everything comes from the heap.
+  static const int PLACE_OCRAM = 0;   // the heap (RAM2, cached); the default
+  static const int PLACE_DTCM = 1;    // the pool given to setDTCMPool() (RAM1, no wait states)
+  static const int PLACE_EXTMEM = 2;  // PSRAM on Teensy 4.1 (falls back to the heap)
+
+  // What setStackGrowth() does with a thread running out of stack
+  static const int GROW_NONE = 0;
+  static const int GROW_RELOCATE = 1; // move the stack to the larger block
+  static const int GROW_RESTART = 2;  // start the thread function over on the larger block
 
 
   // State of threading system
@@ -201,6 +315,12 @@ public:
   static const int ENDED = 2;
   static const int ENDING = 3;
   static const int SUSPENDED = 4;
+  static const int WAITING = 5;     // blocked until woken by the scheduler
+  static const int THROTTLED = 6;   // used up its CPU budget; see setBudget()
+
+  // Scheduling policy for periodic threads
+  static const int EDF = 0;             // earliest deadline first
+  static const int RATE_MONOTONIC = 1;  // shortest period first
 
   static const int SVC_NUMBER = 0x21;
   static const int SVC_NUMBER_ACTIVE = 0x22;
@@ -224,6 +344,17 @@ protected:
 
   ThreadFunctionSleep enter_sleep_callback = NULL;
 
+  int periodic_count = 0;
+  int periodic_policy = EDF;
+  int budget_count = 0;
+  ThreadFunctionInt budget_callback = NULL;
+  int rr_thread = 0;        // round-robin cursor; other picks don't move it
+  int rr_left = 0;          // slice left to rr_thread when a wake preempted it
+  int wake_thread = -1;     // thread to run on the next switch, if RUNNING
+  int handoff_count = 0;    // slice left over for wake_thread; see yieldTo()
+  int tls_count = 0;        // TLS slots handed out by allocTLS()
+  int default_placement = PLACE_OCRAM;
+
 public: // public for debugging
   static IsrFunction save_systick_isr;
   static IsrFunction save_svcall_isr;
@@ -233,18 +364,37 @@ public:
 
   // Create a new thread for function "p", passing argument "arg". If stack is 0,
   // stack allocated on heap. Function "p" has form "void p(void *)".
-  int addThread(ThreadFunction p, void * arg=0, int stack_size=-1, void *stack=0);
+  // arena_size reserves that many bytes for the thread's arenaAlloc().
+  // Leave layout out: it carries the caller's view of the THREADS_ settings.
+  int addThread(ThreadFunction p, void * arg=0, int stack_size=-1, void *stack=0, int arena_size=0,
+                int layout=sizeof(StaticThread));
   // For: void f(int)
-  int addThread(ThreadFunctionInt p, int arg=0, int stack_size=-1, void *stack=0) {
-    return addThread((ThreadFunction)p, (void*)arg, stack_size, stack);
+  int addThread(ThreadFunctionInt p, int arg=0, int stack_size=-1, void *stack=0, int arena_size=0) {
+    return addThread((ThreadFunction)p, (void*)arg, stack_size, stack, arena_size);
+  }
+  // For: void f()
+  int addThread(ThreadFunctionNone p, int arg=0, int stack_size=-1, void *stack=0, int arena_size=0) {
+    return addThread((ThreadFunction)p, (void*)arg, stack_size, stack, arena_size);
   }
+
+  // Create a thread that calls "p" once every period_us microseconds. Each call
+  // (job) should complete within deadline_us of its release (0 means the period).
+  // Ready jobs run before all other threads, ordered by setPeriodicPolicy().
+  // budget_us is the expected execution time, recorded as an overrun if exceeded.
+  int addPeriodicThread(ThreadFunction p, void *arg, unsigned int period_us,
+    unsigned int deadline_us=0, unsigned int budget_us=0, int stack_size=-1, void *stack=0);
   // For: void f()
-  int addThread(ThreadFunctionNone p, int arg=0, int stack_size=-1, void *stack=0) {
-    return addThread((ThreadFunction)p, (void*)arg, stack_size, stack);
+  int addPeriodicThread(ThreadFunctionNone p, unsigned int period_us,
+    unsigned int deadline_us=0, unsigned int budget_us=0, int stack_size=-1, void *stack=0) {
+    return addPeriodicThread((ThreadFunction)p, 0, period_us, deadline_us, budget_us, stack_size, stack);
   }
+  // Order ready periodic jobs by EDF (default) or RATE_MONOTONIC
+  void setPeriodicPolicy(int policy);
+  // Timing statistics of a periodic thread, or NULL if "id" is not periodic
+  const ThreadPeriodic *getPeriodic(int id);
 
   // Get the state; see class constants. Can be EMPTY, RUNNING, etc.
-  int getState(int id);
+  int getState(int id) { return __atomic_load_n(&threadp[id]->flags, __ATOMIC_ACQUIRE); }
   // Explicityly set a state. See getState(). Call with care.
   int setState(int id, int state);
   // Wait until thread returns up to timeout_ms milliseconds. If ms is 0, wait
@@ -255,17 +405,45 @@ public:
   // Suspend execution of current thread for ms milliseconds
   void sleep(int ms);
   // Permanently stop a running thread. Thread will end on the next thread slice tick.
+  // Returns -1 for an empty slot.
   int kill(int id);
   // Suspend a thread (on the next slice tick). Can be restarted with restart().
+  // Returns -1 if the thread has ended.
   int suspend(int id);
-  // Restart a suspended thread.
+  // Restart a suspended (or waiting) thread. Returns -1 if it wasn't either.
   int restart(int id);
   // Set the slice length time in ticks for a thread (1 tick = 1 millisecond, unless using MicroTimer)
   void setTimeSlice(int id, unsigned int ticks);
+  // Limit a thread to budget_ticks of CPU time in every period_ticks. A thread that
+  // uses up its budget is THROTTLED until the next period. Pass 0 to remove the limit.
+  int setBudget(int id, unsigned int budget_ticks, unsigned int period_ticks);
+  // Called with the thread id, from the tick interrupt, when a thread is throttled
+  void setBudgetCallback(ThreadFunctionInt callback);
+  // Number of times a thread was throttled
+  int getBudgetOverruns(int id);
   // Set the slice length time in ticks for all new threads (1 tick = 1 millisecond, unless using MicroTimer)
   void setDefaultTimeSlice(unsigned int ticks);
   // Set the stack size for new threads in bytes
   void setDefaultStackSize(unsigned int bytes_size);
+  // Memory (RAM1 on Teensy 4, so a global array) for stacks placed in PLACE_DTCM.
+  // Returns 0 if the buffer isn't in DTCM.
+  int setDTCMPool(void *buffer, int size);
+  // Place the stacks (and thread data) of new threads; returns the previous placement.
+  // Stacks that don't fit in DTCM or EXTMEM come from the heap.
+  int setDefaultPlacement(int placement);
+  // Where a thread's stack is: PLACE_OCRAM, PLACE_DTCM or PLACE_EXTMEM
+  int getPlacement(int id);
+  // Give a thread a larger stack (bytes or a STACK_ class), used once it has less than
+  // STACK_GROW_MARGIN left at a context switch. mode is GROW_RELOCATE or GROW_RESTART;
+  // GROW_NONE cancels. Returns 0 on error.
+  int setStackGrowth(int id, int mode, int stack_size = STACK_LARGE);
+  // Number of times a thread's stack was grown
+  int getStackGrowths(int id);
+  // Fill the stacks of new threads with STACK_PAINT so getStackHighWater() works
+  void setDefaultStackPaint(bool enable);
+  // Trap stack overflows with an MPU guard region; calls stack_overflow_isr() with the
+  // offending thread still current. Returns 0 if not supported (Teensy 4 only).
+  int setStackGuard(bool enable);
   // Use the microsecond timer provided by IntervalTimer & PIT; instead of 1 tick = 1 millisecond,
   // 1 tick will be the number of microseconds provided (default is 100 microseconds)
   int setMicroTimer(int tick_microseconds = DEFAULT_TICK_MICROSECONDS);
@@ -276,22 +454,69 @@ public:
   // Set sleep callback function
   void setSleepCallback(ThreadFunctionSleep callback);
 
-  // Get the id of the currently running thread
-  int id();
+  // Get the id of the currently running thread. A thread's id can't change
+  // while it runs, so this is a plain read.
+  int id() { return __atomic_load_n(&current_thread, __ATOMIC_RELAXED); }
   int getStackUsed(int id);
   int getStackRemaining(int id);
+  // Deepest stack use in bytes since the thread started; -1 if stack was not painted
+  int getStackHighWater(int id);
+  // Stack size in bytes recommended from the high water mark; -1 if not painted
+  int getStackSuggested(int id);
   char* threadsInfo(void);
 #ifdef DEBUG
   unsigned long getCyclesUsed(int id);
 #endif
 
   // Yield current thread's remaining time slice to the next thread, causing immediate
-  // context switch
-  static void yield();
+  // context switch. Returns at once if no other thread is ready.
+  static inline void yield() {
+    if (currentReadyMask & ~currentBit) __asm volatile("svc %0" : : "i"(Threads::SVC_NUMBER));
+  }
   // Wait for milliseconds using yield(), giving other slices your wait time
   void delay(int millisecond);
-  // Wait for microseconds using yield(), giving other slices your wait time
+  // Wait for microseconds. Waits of DELAY_US_BLOCK or more block the thread on a
+  // one-shot timer and wake it on time; shorter ones (and thread 0) use yield().
   void delay_us(int microsecond);
+  // Switch straight to thread id, giving it the rest of our time slice. Returns 0
+  // (without yielding) if it isn't RUNNING, or a periodic job other than id is ready.
+  int yieldTo(int id);
+  // Block the current thread until micros() reaches wake_us. May return early, so
+  // check your condition in a loop. Returns 0 if the thread can't block.
+  int sleepUntil(uint32_t wake_us);
+
+  // Reserve a thread-local slot (the same index in every thread); returns -1 if
+  // all THREADS_TLS_SLOTS are taken. Slots start at NULL in each new thread.
+  int allocTLS();
+  // Get or set the calling thread's value in a slot. These read the current
+  // thread directly and don't disable interrupts.
+  static inline void *getTLS(int slot) { return currentThread->tls[slot]; }
+  static inline void setTLS(int slot, void *value) { currentThread->tls[slot] = value; }
+
+  // Allocate from the calling thread's arena (see addThread's arena_size): no
+  // locks, no per-object free. Returns NULL if there is no arena or it is full.
+  // Everything is released by arenaReset() and when the thread ends.
+  static inline void *arenaAlloc(size_t size) {
+    ThreadInfo *tp = currentThread;
+    int start = (tp->arena_used + 7) & ~7;
+    if (start + (int)size > tp->arena_size) return NULL;
+    tp->arena_used = start + size;
+    return tp->arena + start;
+  }
+  // Current arena position, to pass to arenaReset() later
+  static inline int arenaMark() { return currentThread->arena_used; }
+  // Free everything allocated in the calling thread's arena since the mark
+  static inline void arenaReset(int mark = 0) {
+    if (mark < currentThread->arena_used) currentThread->arena_used = mark;
+  }
+  // Bytes in use in a thread's arena, or -1
+  int getArenaUsed(int id);
+  // Id of the thread whose arena holds ptr, or -1
+  int inArena(void *ptr);
+  // Route operator new of the calling thread to its arena (falling back to the
+  // heap when full). Needs the library built with THREADS_ARENA_NEW. Returns 0
+  // if the thread has no arena or the hook isn't built.
+  int setArenaNew(bool enable);
   
   // Start/restart threading system; returns previous state: STARTED, STOPPED, FIRST_RUN
   // can pass the previous state to restore
@@ -299,6 +524,15 @@ public:
   // Stop threading system; returns previous state: STARTED, STOPPED, FIRST_RUN
   int stop();
 
+  // Keep the current thread on the CPU until the matching unlockScheduler(); interrupts
+  // still run. Calls nest, and a switch that comes due meanwhile happens on the last
+  // unlock. Cheaper than stop()/start() and safe to nest. Don't block while locked,
+  // and don't use from interrupts.
+  static inline void lockScheduler() { __atomic_add_fetch(&currentLock, 1, __ATOMIC_ACQUIRE); }
+  static inline void unlockScheduler() {
+    if (__atomic_sub_fetch(&currentLock, 1, __ATOMIC_RELEASE) == 0 && currentDeferred) yield();
+  }
+
   // Test all stack markers; if ok return 0; problems, return -1 and set *threadid to id
   int testStackMarkers(int *threadid = NULL);
 
@@ -309,17 +543,39 @@ public:
   friend void threads_systick_isr(void);
   friend void threads_svcall_isr(void);
   friend void loadNextThread();
+  friend int context_switch_tick();
   friend class ThreadLock;
+  friend uint8_t *stack_guard_base(ThreadInfo *tp);
 
 protected:
   void getNextThread();
+  int getNextPeriodic();
+  void waitOn(volatile uint32_t &waiters);
+  int wakeAll(volatile uint32_t &waiters);
+  void handoffTo(int id);
+  void setWake(ThreadInfo *tp, uint32_t wake_us);
+  void wakeArm(uint32_t now);
+public: // called from the wake timer interrupt
+  void wakeRun();
+protected:
+  int tick();
+  void updateTickCheck();
   void *loadstack(ThreadFunction p, void * arg, void *stackaddr, int stack_size);
   static void force_switch_isr();
   void setStackMarker(void *stack);
+  void paintStack(void *stack, int stack_size);
+  uint8_t *placeAlloc(int size, int *place);
+  // Note a thread that became RUNNING. Bits are only cleared by the scheduler,
+  // when it finds the thread isn't RUNNING, so the mask never misses one.
+  static inline void markReady(int id) { __atomic_or_fetch(&currentReadyMask, 1 << id, __ATOMIC_RELAXED); }
+  int changeState(int id, uint32_t from_states, int state);
+  int stackClassSize(int stack_size);
+  void growStack(ThreadInfo *tp);
+  int addStaticThread(StaticThread *st);
 
 private:
   static void del_process(void);
-  void yield_and_start();
+  static void periodic_process(void *arg);
 
 public:
   class Mutex {
@@ -328,12 +584,146 @@ public:
     volatile int waitthread = -1;
     volatile int waitcount = 0;
   public:
-    int getState(); // get the lock state; 1=locked; 0=unlocked
+    int getState() { return __atomic_load_n(&state, __ATOMIC_ACQUIRE); } // get the lock state; 1=locked; 0=unlocked
     int lock(unsigned int timeout_ms = 0); // lock, optionally waiting up to timeout_ms milliseconds
+    int lock_us(unsigned int timeout_us);  // lock, waiting up to timeout_us microseconds (0 = forever)
     int try_lock(); // if lock available, get it and return 1; otherwise return 0
     int unlock();   // unlock if locked
   };
 
+  /*
+   * A Mutex the owning thread can lock again; it is released when unlock()
+   * has been called as many times as lock(). Used for the newlib malloc and
+   * environment locks.
+   */
+  class RecursiveMutex {
+  private:
+    Mutex m;
+    volatile int owner = -1;
+    int count = 0;
+  public:
+    int lock(unsigned int timeout_ms = 0); // lock, optionally waiting up to timeout_ms milliseconds
+    int try_lock(); // if lock available or already ours, get it and return 1; otherwise return 0
+    int unlock();   // undo one lock(); returns 0 if not the owner
+  };
+
+  /*
+   * Reader-writer lock: any number of readers or one writer. Readers get in
+   * with a single atomic update when no writer holds or waits for the lock;
+   * waiting writers keep new readers out so they can't be starved. Threads
+   * that can't get the lock wait off the run list until it is released.
+   */
+  class RWLock {
+  private:
+    static const uint32_t WRITER = 0x80000000;
+    volatile uint32_t state = 0;      // number of readers, or WRITER
+    volatile int writers_waiting = 0;
+    volatile uint32_t waiters = 0;    // bit mask of threads waiting for the lock
+  public:
+    void lock_shared();     // lock for reading, waiting as needed
+    int try_lock_shared();  // if no writer, lock for reading and return 1; otherwise return 0
+    void unlock_shared();   // release a read lock
+    void lock();            // lock for writing, waiting as needed
+    int try_lock();         // if unlocked, lock for writing and return 1; otherwise return 0
+    void unlock();          // release the write lock
+  };
+
+  /*
+   * A flag threads can wait on until a thread or interrupt sets it, such as
+   * at the end of a DMA transfer. wait() takes the thread off the run list
+   * until signal(). From an interrupt, signal() switches to the woken thread
+   * as soon as interrupts are done, through the wake timer's interrupt.
+   */
+  class Event {
+  private:
+    volatile int flag = 0;
+    volatile uint32_t waiters = 0;   // bit mask of threads waiting
+  public:
+    int wait(unsigned int timeout_us = 0); // wait until set, then clear it; 0 on timeout. Not from interrupts.
+    void signal();                  // set it and wake waiters; also from interrupts
+    void clear() { flag = 0; }
+    int isSet() { return flag; }
+  };
+
+  /*
+   * One-shot and periodic software timers, whose callbacks all run in one
+   * daemon thread started by begin(). Timers are kept in a list sorted by
+   * expiry; the daemon sleeps on the wake timer until the first one is due.
+   * start(), stop() and reset() can be called from threads and interrupts.
+   * Callbacks run one at a time, so keep them short.
+   *
+   *   void blink(void *arg) { digitalToggle(13); }
+   *   Threads::Timer blinker(blink);
+   *   void setup() { Threads::Timer::begin(); blinker.start(0, 500000); }
+   */
+  class Timer {
+  public:
+    typedef void (*Callback)(void *arg);
+  private:
+    Callback callback;
+    void *arg;
+    uint32_t expires = 0;
+    uint32_t delay_us = 0;
+    uint32_t period_us = 0;
+    volatile int active = 0;
+    Timer *next = 0;
+    static Timer *head;
+    static Event changed;
+    static int daemon_id;
+    void insert();
+    void unlink();
+    static void run(void *arg);
+  public:
+    constexpr Timer(Callback callback, void *arg = 0) : callback(callback), arg(arg) { }
+    // Call callback after delay_us, then every period_us if not 0. Restarts an active timer.
+    void start(uint32_t delay_us, uint32_t period_us = 0);
+    void stop();
+    void reset() { start(delay_us, period_us); } // start again with the same times
+    int isActive() { return active; }
+    // Start the daemon thread with a time slice of slice_ticks (0 for the
+    // default); returns its id. The slice stands in for a priority: a woken
+    // daemon runs first unless a periodic job is ready, for up to that long.
+    static int begin(int stack_size = 1024, int slice_ticks = 0);
+  };
+
+  /*
+   * Work that an interrupt hands to a thread, so the handler itself stays
+   * short. Items are allocated by the caller and posted to a WorkQueue,
+   * whose worker thread (started by begin()) runs them in order. post() is
+   * a compare-and-swap push, safe from any interrupt; the worker takes the
+   * whole list at once and is switched to as soon as interrupts are done.
+   *
+   *   void process(void *arg) { ... }
+   *   Threads::WorkQueue queue;
+   *   Threads::Work work(process);
+   *   void adc_isr() { queue.post(work); }
+   *   void setup() { queue.begin(); }
+   */
+  class WorkQueue;
+  class Work {
+  private:
+    void (*func)(void *arg);
+    void *arg;
+    Work *next = 0;
+    volatile int pending = 0;
+    friend class WorkQueue;
+  public:
+    constexpr Work(void (*func)(void *arg), void *arg = 0) : func(func), arg(arg) { }
+    int isPending() { return pending; }
+  };
+
+  class WorkQueue {
+  private:
+    Work * volatile head = 0;  // posted items, newest first
+    Event posted;
+    static void run(void *arg);
+  public:
+    // Queue work to run once; returns 0 if it is already queued. Safe from interrupts.
+    int post(Work &work);
+    // Start the worker thread; returns its id
+    int begin(int stack_size = 1024);
+  };
+
   class Scope {
   private:
     Mutex *r;
@@ -342,22 +732,163 @@ public:
     ~Scope() { r->unlock(); }
   };
 
+  // Use a placement for threads created in a block: Placement p(Threads::PLACE_DTCM);
+  class Placement {
+  private:
+    int save;
+  public:
+    Placement(int placement);
+    ~Placement();
+  };
+
+  // Free arena allocations made in a block when it ends
+  class ArenaScope {
+  private:
+    int mark;
+  public:
+    ArenaScope() { mark = Threads::arenaMark(); }
+    ~ArenaScope() { Threads::arenaReset(mark); }
+  };
+
   class Suspend {
+  public:
+    Suspend() { lockScheduler(); }    // Keep other threads from running
+    ~Suspend() { unlockScheduler(); } // Let them run again
+  };
+
+  // Same as Suspend
+  typedef Suspend SchedulerLock;
+
+  /*
+   * A thread whose data and stack are static variables instead of heap
+   * memory; see THREADS_DEFINE(). It takes a thread slot once both it and
+   * "threads" have been constructed, in either order. With autostart, it is
+   * RUNNING and begins when threading starts; otherwise it is SUSPENDED until
+   * restart(id()). ticks is the time slice; 0 for the default.
+   */
+  class StaticThread {
   private:
-    int save_state;
+    ThreadFunction func;
+    void *arg;
+    uint8_t *stack;
+    int stack_size;
+    int ticks;
+    int autostart;
+    volatile int thread_id;
+    StaticThread *next;
+    ThreadInfo info;
+#if THREADS_TLS_SIZE
+    uint8_t tls_block[THREADS_TLS_SIZE] __attribute__((aligned(8)));
+#endif
+#if THREADS_NEWLIB_REENT
+    struct _reent reent;
+#endif
+    friend class Threads;
   public:
-    Suspend();      // Stop threads and save thread state
-    ~Suspend();     // Restore saved state
+    StaticThread(ThreadFunction func, void *arg, void *stack, int stack_size, int ticks=0, int autostart=1,
+                 int layout=sizeof(StaticThread));
+    int id() const { return thread_id; } // thread id, or -1 if no slot was free
   };
 
+  /*
+   * Share a value from one writer with any number of readers, including
+   * interrupts, without locking. There are two copies: the writer fills the
+   * one readers aren't using and then flips a sequence counter, so it never
+   * waits. A reader copies the current one and retries only if the writer
+   * has since started overwriting that same copy (two publishes later). An
+   * interrupt can't be overtaken by a thread writer, so it never retries.
+   */
+  template <class T> class Published {
+    private:
+      T buf[2];
+      volatile uint32_t seq = 0;  // twice the version; odd while publishing
+    public:
+      Published() { }
+      Published(const T &value) { buf[0] = value; }
+      // Make a new value visible to readers. Only one writer may publish.
+      void publish(const T &value) {
+        uint32_t s = seq;
+        seq = s + 1;
+        __asm__ volatile("dmb" ::: "memory");
+        buf[((s >> 1) + 1) & 1] = value;
+        __asm__ volatile("dmb" ::: "memory");
+        seq = s + 2;
+      }
+      // Copy the latest value into "value" and return its version
+      uint32_t read(T &value) const {
+        while (1) {
+          uint32_t s1 = seq;
+          __asm__ volatile("dmb" ::: "memory");
+          value = buf[(s1 >> 1) & 1];
+          __asm__ volatile("dmb" ::: "memory");
+          if (seq - (s1 & ~1) <= 2) return s1 >> 1;
+        }
+      }
+      T read() const { T value; read(value); return value; }
+      // Number of times publish() has completed
+      uint32_t version() const { return seq >> 1; }
+  };
+
+  /*
+   * A Print that never blocks the threads printing to it. Each thread fills
+   * its own line buffer; complete lines are copied into a shared ring
+   * without locks, and a drain thread started by begin() writes them to the
+   * real output in large batches. Lines that don't fit in the ring are
+   * dropped and counted. Don't print to it from interrupts.
+   *
+   *   Threads::AsyncPrint Log(Serial);
+   *   void setup() { Log.begin(); }
+   *   void thread_func() { Log.println("hello"); }
+   */
+  class AsyncPrint : public Print {
+  private:
+    static const uint8_t READY = 0xA5;
+    Print *out;
+    uint8_t *ring = 0;
+    uint32_t ring_size;       // power of 2
+    volatile uint32_t head = 0; // next free byte, claimed by writers
+    volatile uint32_t tail = 0; // next byte to drain
+    uint8_t *lines = 0;       // MAX_THREADS line buffers
+    int line_size;
+    uint8_t line_len[MAX_THREADS];
+    volatile unsigned long dropped = 0;
+    void commit(const uint8_t *line, int len);
+    static void drain(void *arg);
+  public:
+    static const int DRAIN_POLL_US = 1000;
+    // ring_size is rounded up to a power of 2; line_size is at most 255
+    AsyncPrint(Print &output, int ring_size = 1024, int line_size = 80);
+    // Allocate the buffers and start the drain thread; returns its id or -1
+    int begin(int stack_size = -1);
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t *data, size_t size);
+    using Print::write;
+    // Send the calling thread's unfinished line
+    virtual void flush();
+    // Number of lines dropped because the ring was full
+    unsigned long getDropped() { return dropped; }
+  };
+
+  /*
+   * Scoped accessor returned by Grab::grab(). The lock is held from creation
+   * until it goes out of scope, so several calls can be made with one lock:
+   *
+   *   auto s = SerialXtra.grab();
+   *   s->print(a);
+   *   s->print(b);
+   */
   template <class C> class GrabTemp {
     private:
       Mutex *lkp;
     public:
       C *me;
       GrabTemp(C *obj, Mutex *lk) { me = obj; lkp=lk; lkp->lock(); }
-      ~GrabTemp() { lkp->unlock(); }
+      GrabTemp(GrabTemp &&t) { me = t.me; lkp = t.lkp; t.lkp = 0; }
+      GrabTemp(const GrabTemp &) = delete;
+      ~GrabTemp() { if (lkp) lkp->unlock(); }
       C &get() { return *me; }
+      C &operator*() { return *me; }
+      C *operator->() { return me; }
   };
 
   template <class T> class Grab {
@@ -367,9 +898,47 @@ public:
     public:
       Grab(T &t) { me = &t; }
       GrabTemp<T> grab() { return GrabTemp<T>(me, &lk); }
-      operator T&() { return grab().get(); }
-      T *operator->() { return grab().me; }
+      // Access without locking; use grab() to hold the lock
+      operator T&() { return *me; }
+      // Locked for the duration of the expression, e.g. SerialXtra->print(a)
+      GrabTemp<T> operator->() { return grab(); }
       Mutex &getLock() { return lk; }
+
+      /*
+       * For Print objects: collect output in a buffer local to the calling
+       * thread and write it with a single lock when the buffer fills, on
+       * flush() or at the end of scope. Lines written through a Batch
+       * never interleave with other threads' output.
+       *
+       *   auto out = SerialXtra.batch();
+       *   out.print(a);
+       *   out.println(b);
+       */
+      template <int N = 128> class Batch : public Print {
+        private:
+          Grab *g;
+          uint8_t buf[N];
+          int len = 0;
+        public:
+          Batch(Grab &grab) { g = &grab; }
+          ~Batch() { flush(); }
+          virtual size_t write(uint8_t c) {
+            if (len == N) flush();
+            buf[len++] = c;
+            return 1;
+          }
+          virtual size_t write(const uint8_t *data, size_t size) {
+            for (size_t i=0; i<size; i++) write(data[i]);
+            return size;
+          }
+          virtual void flush() {
+            if (len == 0) return;
+            GrabTemp<T> lock = g->grab();
+            lock->write(buf, len);
+            len = 0;
+          }
+      };
+      Batch<> batch() { return Batch<>(*this); }
   };
 
 #define ThreadWrap(OLDOBJ, NEWOBJ) Threads::Grab<decltype(OLDOBJ)> NEWOBJ(OLDOBJ);
@@ -380,6 +949,21 @@ public:
 
 extern Threads threads;
 
+/*
+ * Define a thread at file scope with its stack in .bss, or in the section
+ * given by the attribute of THREADS_DEFINE_IN() (e.g. DMAMEM or EXTMEM):
+ *
+ *   THREADS_DEFINE(blinker, blink_thread, 0, 1024, 0);
+ *   THREADS_DEFINE_IN(DMAMEM, logger, log_thread, 0, 4096, 0);
+ *
+ * "name" is the Threads::StaticThread; name.id() is its thread id.
+ */
+#define THREADS_DEFINE_IN(attr, name, func, arg, stack_size, ticks) \
+  static uint8_t name##_stack[((stack_size) + 7) & ~7] attr __attribute__((aligned(8))); \
+  Threads::StaticThread name((ThreadFunction)(func), (void*)(arg), name##_stack, sizeof(name##_stack), ticks)
+#define THREADS_DEFINE(name, func, arg, stack_size, ticks) \
+  THREADS_DEFINE_IN(, name, func, arg, stack_size, ticks)
+
 /*
  * Rudimentary compliance to C++11 class
  *
@@ -440,6 +1024,26 @@ namespace std {
       explicit lock_guard(cMutex& m) { r = &m; r->lock(); }
       ~lock_guard() { r->unlock(); }
   };
+
+  class shared_mutex {
+    private:
+      Threads::RWLock rw;
+    public:
+      void lock() { rw.lock(); }
+      bool try_lock() { return rw.try_lock(); }
+      void unlock() { rw.unlock(); }
+      void lock_shared() { rw.lock_shared(); }
+      bool try_lock_shared() { return rw.try_lock_shared(); }
+      void unlock_shared() { rw.unlock_shared(); }
+  };
+
+  template <class cMutex> class shared_lock {
+    private:
+      cMutex *r;
+    public:
+      explicit shared_lock(cMutex& m) { r = &m; r->lock_shared(); }
+      ~shared_lock() { r->unlock_shared(); }
+  };
 }
 
 #endif
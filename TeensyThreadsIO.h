@@ -0,0 +1,96 @@
+/*
+ * TeensyThreadsIO.h - Thread-blocking I/O for the Teensy threading library.
+ *
+ *******************
+ *
+ * Copyright 2017 by Fernando Trias.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+ * and associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ *******************
+ *
+ * Transfers started here run by DMA while the calling thread waits off the
+ * run list, instead of spinning through its time slice. The completion
+ * interrupt wakes it with a Threads::Event. Kept apart from TeensyThreads.h
+ * so sketches that don't use it don't pull in SPI.
+ *
+ *   ThreadSPI bus(SPI);
+ *
+ *   void sensor_thread() {
+ *     while(1) {
+ *       bus.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE0));
+ *       digitalWrite(CS_PIN, LOW);
+ *       bus.transfer(cmd, reply, sizeof(reply));  // other threads run meanwhile
+ *       digitalWrite(CS_PIN, HIGH);
+ *       bus.endTransaction();
+ *     }
+ *   }
+ */
+
+#ifndef _THREADS_IO_H
+#define _THREADS_IO_H
+
+#include <TeensyThreads.h>
+#include <SPI.h>
+#include <EventResponder.h>
+
+/*
+ * An SPI bus shared by threads. beginTransaction() also locks the bus for
+ * the calling thread, and transfer() blocks only the caller while the DMA
+ * runs. If the SPI library has no DMA transfers, transfer() is the usual
+ * blocking one.
+ */
+class ThreadSPI {
+private:
+  SPIClass *spi;
+  Threads::Mutex bus;
+  Threads::Event done;
+#ifdef SPI_HAS_TRANSFER_ASYNC
+  EventResponder responder;
+  // called from the DMA interrupt
+  static void complete(EventResponderRef r) {
+    ((ThreadSPI*)r.getContext())->done.signal();
+  }
+#endif
+public:
+  ThreadSPI(SPIClass &spi) : spi(&spi) {
+#ifdef SPI_HAS_TRANSFER_ASYNC
+    responder.setContext(this);
+    responder.attachImmediate(complete);
+#endif
+  }
+  void beginTransaction(SPISettings settings) { bus.lock(); spi->beginTransaction(settings); }
+  void endTransaction() { spi->endTransaction(); bus.unlock(); }
+  // Send tx and receive into rx (either may be NULL); returns 0 if it took
+  // longer than timeout_us. The SPI library can't cancel a DMA transfer, so
+  // it still returns only once the DMA is done with tx and rx.
+  int transfer(const void *tx, void *rx, size_t count, unsigned int timeout_us = 0) {
+#ifdef SPI_HAS_TRANSFER_ASYNC
+    done.clear();
+    if (! spi->transfer(tx, rx, count, responder)) return 0;
+    if (done.wait(timeout_us)) return 1;
+    done.wait();
+    return 0;
+#else
+    (void)timeout_us;
+    spi->transfer(tx, rx, count);
+    return 1;
+#endif
+  }
+  Threads::Mutex &getLock() { return bus; }
+};
+
+#endif
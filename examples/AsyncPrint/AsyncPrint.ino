@@ -0,0 +1,39 @@
+/*
+ * Several threads log through one AsyncPrint. Printing never blocks the
+ * workers, even while Serial is slow or not connected; lines are handed to
+ * a drain thread and written to Serial in batches.
+ */
+#include <TeensyThreads.h>
+
+Threads::AsyncPrint Log(Serial, 4096);
+
+void worker(int n) {
+  unsigned long count = 0;
+  while(1) {
+    elapsedMicros t;
+    Log.print("thread ");
+    Log.print(n);
+    Log.print(" line ");
+    Log.println(count++);
+    unsigned long us = t;
+    if (us > 50) {
+      Log.print("thread ");
+      Log.print(n);
+      Log.print(" slow print us=");
+      Log.println(us);
+    }
+    threads.delay(n * 10);
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  Log.begin();
+  for (int i=1; i<=4; i++) threads.addThread(worker, i);
+}
+
+void loop() {
+  Log.print("dropped ");
+  Log.println(Log.getDropped());
+  threads.delay(1000);
+}
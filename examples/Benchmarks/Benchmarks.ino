@@ -0,0 +1,302 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Cycle counts (DWT CYCCNT) of the scheduler and synchronization primitives,
+// printed as CSV so runs of different library versions and configurations
+// can be compared. Lines starting with # describe the configuration.
+//
+// To compare tick sources, set SLICE_US to use setSliceMicros() (the PIT on
+// Teensy 3) instead of the default millisecond tick. To compare FPU
+// settings, build with and without the FPU (the context switch saves its
+// registers when it is in use).
+
+const int SAMPLES = 1000;
+const int SLICE_US = 0;      // 0 for the default tick
+const int SPIN_MS = 500;     // how long to run the tick-driven tests
+
+struct Stats {
+  uint32_t n = 0;
+  uint32_t min = 0xFFFFFFFF;
+  uint32_t max = 0;
+  uint64_t sum = 0;
+  void add(uint32_t cycles) {
+    n++;
+    sum += cycles;
+    if (cycles < min) min = cycles;
+    if (cycles > max) max = cycles;
+  }
+  void print(const char *name) {
+    Serial.print(name);
+    Serial.print(",");
+    Serial.print(n);
+    Serial.print(",");
+    Serial.print(n ? min : 0);
+    Serial.print(",");
+    Serial.print(n ? (uint32_t)(sum / n) : 0);
+    Serial.print(",");
+    Serial.println(max);
+  }
+};
+
+volatile int running;
+
+// yield round-trip: main yields to one thread that yields straight back
+
+void yield_back_thread() {
+  while (running) threads.yield();
+}
+
+void bench_yield() {
+  Stats s;
+  running = 1;
+  int id = threads.addThread(yield_back_thread);
+  threads.yield();
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    threads.yield();
+    s.add(ARM_DWT_CYCCNT - t);
+  }
+  running = 0;
+  threads.wait(id, 100);
+  s.print("yield_round_trip");
+}
+
+// Tick-driven switch and slice length: main and one thread spin, stamping
+// the cycle counter. The gap seen when the other one takes over is the cost
+// of the tick interrupt and switch; the time between taking over and being
+// switched out is the slice, whose spread is the jitter.
+
+volatile int owner;
+volatile uint32_t stamp;
+volatile uint32_t acquired;
+Stats tick_switch, slice;
+
+void spin_step(int me) {
+  __disable_irq();
+  uint32_t now = ARM_DWT_CYCCNT;
+  if (owner != me) {
+    if (owner >= 0) {
+      tick_switch.add(now - stamp);
+      slice.add(stamp - acquired);
+    }
+    owner = me;
+    acquired = now;
+  }
+  stamp = now;
+  __enable_irq();
+}
+
+void spin_thread() {
+  while (running) spin_step(1);
+}
+
+void bench_tick() {
+  owner = -1;
+  running = 1;
+  int id = threads.addThread(spin_thread);
+  elapsedMillis t;
+  while (t < SPIN_MS) spin_step(0);
+  running = 0;
+  threads.wait(id, 100);
+  tick_switch.print("tick_switch");
+  slice.print("slice");
+}
+
+// Thread create/destroy: addThread() alone, and until the thread has run
+// and ended
+
+void empty_thread() {
+}
+
+void bench_create() {
+  Stats create, lifetime;
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    int id = threads.addThread(empty_thread);
+    create.add(ARM_DWT_CYCCNT - t);
+    while (threads.getState(id) != Threads::ENDED) threads.yield();
+    lifetime.add(ARM_DWT_CYCCNT - t);
+  }
+  create.print("thread_create");
+  lifetime.print("thread_create_run_end");
+}
+
+// Mutex: uncontended lock/unlock, and handoff from unlock() to a thread
+// waiting in lock()
+
+Threads::Mutex mutex;
+Threads::Event go;
+volatile uint32_t released;
+volatile int handoffs;
+Stats handoff;
+
+void mutex_thread() {
+  while (running) {
+    go.wait();
+    if (! running) break;
+    mutex.lock();
+    handoff.add(ARM_DWT_CYCCNT - released);
+    handoffs++;
+    mutex.unlock();
+  }
+}
+
+void bench_mutex() {
+  Stats s;
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    mutex.lock();
+    mutex.unlock();
+    s.add(ARM_DWT_CYCCNT - t);
+  }
+  s.print("mutex_uncontended");
+
+  running = 1;
+  handoffs = 0;
+  int id = threads.addThread(mutex_thread);
+  for (int i=0; i<SAMPLES; i++) {
+    mutex.lock();
+    go.signal();
+    while (threads.getState(id) != Threads::WAITING) threads.yield();
+    released = ARM_DWT_CYCCNT;
+    mutex.unlock();
+    while (handoffs == i) threads.yield();
+  }
+  running = 0;
+  go.signal();
+  threads.wait(id, 100);
+  handoff.print("mutex_handoff");
+}
+
+// Ping-pong between two threads through a pair of Events (the library's
+// binary semaphore); each sample is one round trip
+
+Threads::Event ping, pong;
+
+void pong_thread() {
+  while (running) {
+    ping.wait();
+    pong.signal();
+  }
+}
+
+void bench_ping_pong() {
+  Stats s;
+  running = 1;
+  int id = threads.addThread(pong_thread);
+  for (int i=0; i<SAMPLES; i++) {
+    uint32_t t = ARM_DWT_CYCCNT;
+    ping.signal();
+    pong.wait();
+    s.add(ARM_DWT_CYCCNT - t);
+  }
+  running = 0;
+  ping.signal();
+  threads.wait(id, 100);
+  s.print("event_ping_pong");
+}
+
+// ISR-to-thread wake: a timer interrupt signals an Event that a thread waits
+// on, while another thread keeps the CPU busy
+
+IntervalTimer wake_timer;
+Threads::Event wake_event;
+volatile uint32_t isr_stamp;
+volatile int wakes;
+Stats wake_latency;
+
+void wake_isr() {
+  isr_stamp = ARM_DWT_CYCCNT;
+  wake_event.signal();
+}
+
+void wake_thread() {
+  while (running) {
+    if (! wake_event.wait(10000)) continue;
+    wake_latency.add(ARM_DWT_CYCCNT - isr_stamp);
+    wakes++;
+  }
+}
+
+void busy_thread() {
+  while (running) ;
+}
+
+void bench_isr_wake() {
+  running = 1;
+  wakes = 0;
+  int id = threads.addThread(wake_thread);
+  int busy = threads.addThread(busy_thread);
+  threads.delay(10);
+  wake_timer.begin(wake_isr, 1000);
+  while (wakes < SAMPLES) threads.yield();
+  wake_timer.end();
+  running = 0;
+  threads.wait(id, 100);
+  threads.wait(busy, 100);
+  wake_latency.print("isr_wake_latency");
+}
+
+// ISR-to-work: the same, but the interrupt posts an item to a WorkQueue
+
+Threads::WorkQueue work_queue;
+Stats work_latency;
+
+void work_func(void *arg) {
+  work_latency.add(ARM_DWT_CYCCNT - isr_stamp);
+  wakes++;
+}
+
+Threads::Work work(work_func);
+
+void work_isr() {
+  isr_stamp = ARM_DWT_CYCCNT;
+  work_queue.post(work);
+}
+
+void bench_work_queue() {
+  running = 1;
+  wakes = 0;
+  int id = work_queue.begin();
+  int busy = threads.addThread(busy_thread);
+  threads.delay(10);
+  wake_timer.begin(work_isr, 1000);
+  while (wakes < SAMPLES) threads.yield();
+  wake_timer.end();
+  running = 0;
+  threads.wait(busy, 100);
+  threads.kill(id);
+  work_latency.print("isr_work_latency");
+}
+
+void setup() {
+  delay(1000);
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;  // make sure the cycle counter runs
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  threads.setDefaultStackSize(1024);
+  if (SLICE_US) threads.setSliceMicros(SLICE_US);
+
+  Serial.print("# F_CPU=");
+  Serial.println(F_CPU);
+#ifdef __ARM_PCS_VFP
+  Serial.println("# fpu=on");
+#else
+  Serial.println("# fpu=off");
+#endif
+#ifdef __IMXRT1062__
+  Serial.println(SLICE_US ? "# tick=GPT,us" : "# tick=GPT,ms");
+#else
+  Serial.println(SLICE_US ? "# tick=PIT,us" : "# tick=SysTick,ms");
+#endif
+  Serial.println("benchmark,samples,min_cycles,avg_cycles,max_cycles");
+  bench_yield();
+  bench_tick();
+  bench_create();
+  bench_mutex();
+  bench_ping_pong();
+  bench_isr_wake();
+  bench_work_queue();
+}
+
+void loop() {
+}
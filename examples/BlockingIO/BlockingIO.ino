@@ -0,0 +1,99 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Compare sensor threads that poll for the end of a transfer with ones that
+// block on a Threads::Event until the completion interrupt signals it, as
+// ThreadSPI in TeensyThreadsIO.h does for SPI DMA. The bus is a stand-in
+// that needs no wiring: a transfer "loops back" tx to rx in a timer
+// interrupt BYTE_US microseconds per byte after it starts. The main thread
+// counts how much work it gets done meanwhile. Prints CSV.
+
+const int SENSORS = 3;
+const int BYTE_US = 2;          // about 4MHz SPI
+const int TRANSFER_SIZE = 64;
+const int RUN_MS = 1000;
+
+class LoopbackBus {
+private:
+  IntervalTimer timer;
+  const uint8_t *tx;
+  uint8_t *rx;
+  size_t count;
+  volatile int busy = 0;
+  Threads::Event done;
+  static LoopbackBus *active;
+  static void complete() {
+    LoopbackBus *b = active;
+    b->timer.end();
+    memcpy(b->rx, b->tx, b->count);
+    b->busy = 0;
+    b->done.signal();
+  }
+public:
+  Threads::Mutex lock;
+  int polling = 0;
+  void transfer(const uint8_t *t, uint8_t *r, size_t n) {
+    tx = t;
+    rx = r;
+    count = n;
+    busy = 1;
+    done.clear();
+    active = this;
+    timer.begin(complete, n * BYTE_US);
+    if (polling) while (busy) ;
+    else done.wait();
+  }
+};
+
+LoopbackBus *LoopbackBus::active;
+LoopbackBus bus;
+
+volatile int running = 0;
+volatile unsigned long transfers = 0;
+volatile unsigned long errors = 0;
+
+void sensor_thread(int n) {
+  uint8_t tx[TRANSFER_SIZE], rx[TRANSFER_SIZE];
+  for (int i=0; i<TRANSFER_SIZE; i++) tx[i] = n + i;
+  while (running) {
+    bus.lock.lock();
+    bus.transfer(tx, rx, sizeof(tx));
+    bus.lock.unlock();
+    if (memcmp(tx, rx, sizeof(tx))) errors++;
+    transfers++;
+  }
+}
+
+void measure(int polling) {
+  bus.polling = polling;
+  transfers = 0;
+  errors = 0;
+  running = 1;
+  int ids[SENSORS];
+  for (int i=0; i<SENSORS; i++) ids[i] = threads.addThread(sensor_thread, i);
+
+  volatile unsigned long work = 0;
+  elapsedMillis t;
+  while (t < RUN_MS) work++;
+
+  running = 0;
+  for (int i=0; i<SENSORS; i++) threads.wait(ids[i], 100);
+
+  Serial.print(polling ? "polling" : "blocking");
+  Serial.print(",");
+  Serial.print(transfers);
+  Serial.print(",");
+  Serial.print(errors);
+  Serial.print(",");
+  Serial.println(work);
+}
+
+void setup() {
+  delay(1000);
+  Serial.println("mode,transfers,errors,main_thread_work");
+  measure(1);
+  measure(0);
+}
+
+void loop() {
+}
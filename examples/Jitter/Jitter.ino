@@ -0,0 +1,62 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Compare how late a thread wakes from a 50 microsecond wait when other
+// threads are busy, using the old yield() loop and the timer-based
+// threads.delay_us(). Prints a histogram of the lateness of each.
+
+const int WAIT_US = 50;
+const int SAMPLES = 1000;
+const int BUCKET_US = 10;
+const int BUCKETS = 21;  // last bucket holds everything later
+
+volatile int busy_count = 0;
+
+void busy_thread() {
+  while(1) busy_count++;
+}
+
+// the delay_us() implementation before the wake timer
+void yield_delay_us(int microsecond) {
+  int mx = micros();
+  while ((int)micros() - mx < microsecond) threads.yield();
+}
+
+int histogram[2][BUCKETS];
+volatile int done = 0;
+
+void measure_thread() {
+  for (int method=0; method<2; method++) {
+    for (int i=0; i<SAMPLES; i++) {
+      uint32_t start = micros();
+      if (method == 0) yield_delay_us(WAIT_US);
+      else threads.delay_us(WAIT_US);
+      int late = micros() - start - WAIT_US;
+      int bucket = late / BUCKET_US;
+      if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+      histogram[method][bucket]++;
+    }
+  }
+  done = 1;
+}
+
+void setup() {
+  delay(1000);
+  threads.addThread(busy_thread);
+  threads.addThread(busy_thread);
+  threads.addThread(measure_thread);
+  while (! done) threads.yield();
+
+  Serial.println("late_us,yield_loop,delay_us");
+  for (int b=0; b<BUCKETS; b++) {
+    if (b == BUCKETS - 1) Serial.print(">=");
+    Serial.print(b * BUCKET_US);
+    Serial.print(",");
+    Serial.print(histogram[0][b]);
+    Serial.print(",");
+    Serial.println(histogram[1][b]);
+  }
+}
+
+void loop() {
+}
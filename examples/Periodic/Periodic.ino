@@ -0,0 +1,45 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Two control loops at fixed rates. Jobs are released by the scheduler
+// tick, so use a tick much shorter than the fastest period.
+
+volatile int fast_count = 0;
+volatile int slow_count = 0;
+
+void fast_loop() {        // 1 kHz
+  fast_count++;
+}
+
+void slow_loop() {        // 250 Hz
+  slow_count++;
+  delayMicroseconds(500); // pretend to do some work
+}
+
+int fast_id, slow_id;
+
+void show(const char *name, int id) {
+  const ThreadPeriodic *pp = threads.getPeriodic(id);
+  Serial.print(name);
+  Serial.print(" jobs:");
+  Serial.print(pp->jobs);
+  Serial.print(" misses:");
+  Serial.print(pp->misses);
+  Serial.print(" jitter(us):");
+  Serial.print(pp->max_jitter_us);
+  Serial.print(" response(us):");
+  Serial.println(pp->max_response_us);
+}
+
+void setup() {
+  delay(1000);
+  threads.setMicroTimer(50);
+  fast_id = threads.addPeriodicThread(fast_loop, 1000);
+  slow_id = threads.addPeriodicThread(slow_loop, 4000, 2000);
+}
+
+void loop() {
+  threads.delay(1000);
+  show("1kHz ", fast_id);
+  show("250Hz", slow_id);
+}
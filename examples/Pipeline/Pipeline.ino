@@ -0,0 +1,76 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// A three-stage pipeline sharing the CPU with busy background threads.
+// Each stage passes its buffer on and then either yields to whoever the
+// round-robin picks next, or hands the CPU straight to the next stage with
+// threads.yieldTo(). Prints the average and worst time from the first
+// stage to the last for both.
+
+const int STAGES = 3;
+const int BUSY = 4;
+const int ROUNDS = 50;
+
+volatile int full[STAGES];       // stage i has a buffer to work on
+volatile int done;
+volatile uint32_t started;
+volatile int handoff = 0;
+int stage_id[STAGES];
+
+void busy_thread() {
+  volatile int n = 0;
+  while(1) n++;
+}
+
+void work() {
+  volatile float x = 1;
+  for (int i=0; i<200; i++) x = x * 1.0001f;
+}
+
+void pass_on(int next) {
+  full[next] = 1;
+  if (handoff) threads.yieldTo(stage_id[next]);
+  else threads.yield();
+}
+
+void stage(int n) {
+  while(1) {
+    while (! full[n]) threads.yield();
+    full[n] = 0;
+    work();
+    if (n + 1 < STAGES) pass_on(n + 1);
+    else done = 1;  // tell the main thread
+  }
+}
+
+void measure(const char *name) {
+  uint32_t total = 0, worst = 0;
+  for (int r=0; r<ROUNDS; r++) {
+    done = 0;
+    started = micros();
+    pass_on(0);
+    while (! done) threads.yield();
+    uint32_t us = micros() - started;
+    total += us;
+    if (us > worst) worst = us;
+  }
+  Serial.print(name);
+  Serial.print(",");
+  Serial.print(total / ROUNDS);
+  Serial.print(",");
+  Serial.println(worst);
+}
+
+void setup() {
+  delay(1000);
+  for (int i=0; i<STAGES; i++) stage_id[i] = threads.addThread(stage, i);
+  for (int i=0; i<BUSY; i++) threads.addThread(busy_thread);
+  Serial.println("method,avg_us,max_us");
+  handoff = 0;
+  measure("yield");
+  handoff = 1;
+  measure("yieldTo");
+}
+
+void loop() {
+}
@@ -0,0 +1,90 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Teensy 4: compare thread stacks in DTCM (RAM1), OCRAM (RAM2, the heap)
+// and EXTMEM (PSRAM on Teensy 4.1). For each placement, measure the cycles
+// of a DSP loop working on buffers on the thread stack, and the cycles per
+// context switch of threads yielding to each other. Prints CSV.
+
+const int STACK_SIZE = 6144;
+const int TAPS = 16;
+const int LEN = 512;
+const int PASSES = 50;
+const int SWITCH_MS = 200;
+
+// globals are in DTCM on Teensy 4, so this becomes the pool
+uint8_t dtcm_pool[4 * STACK_SIZE];
+
+volatile uint32_t dsp_cycles;
+volatile int dsp_done;
+volatile uint32_t switches;
+volatile int switching;
+
+void dsp_thread() {
+  float x[LEN], y[LEN];
+  float h[TAPS];
+  for (int i=0; i<LEN; i++) x[i] = (i % 37) * 0.01f;
+  for (int k=0; k<TAPS; k++) h[k] = 1.0f / TAPS;
+  uint32_t start = ARM_DWT_CYCCNT;
+  for (int n=0; n<PASSES; n++) {
+    for (int i=TAPS; i<LEN; i++) {
+      float acc = 0;
+      for (int k=0; k<TAPS; k++) acc += x[i-k] * h[k];
+      y[i] = acc;
+    }
+    x[n] = y[LEN - 1 - n];
+  }
+  dsp_cycles = (ARM_DWT_CYCCNT - start) / PASSES;
+  dsp_done = 1;
+}
+
+void switch_thread() {
+  while (! switching) threads.yield();
+  while (switching) {
+    switches++;
+    threads.yield();
+  }
+}
+
+void measure(int placement, const char *name) {
+  Threads::Placement place(placement);
+
+  dsp_done = 0;
+  int id = threads.addThread(dsp_thread, 0, STACK_SIZE);
+  threads.setTimeSlice(id, 1000); // run the loop without being switched out
+  while (! dsp_done) threads.yield();
+  int where = threads.getPlacement(id);
+
+  switches = 0;
+  int a = threads.addThread(switch_thread, 0, 1024);
+  int b = threads.addThread(switch_thread, 0, 1024);
+  switching = 1;
+  uint32_t start = ARM_DWT_CYCCNT;
+  threads.delay(SWITCH_MS);
+  switching = 0;
+  uint32_t cycles = ARM_DWT_CYCCNT - start;
+  threads.wait(a, 100);
+  threads.wait(b, 100);
+
+  Serial.print(name);
+  Serial.print(",");
+  Serial.print(where == placement ? "yes" : "no");
+  Serial.print(",");
+  Serial.print(dsp_cycles);
+  Serial.print(",");
+  Serial.println(switches ? cycles / switches : 0);
+}
+
+void setup() {
+  delay(1000);
+  if (! threads.setDTCMPool(dtcm_pool, sizeof(dtcm_pool))) {
+    Serial.println("DTCM pool not in DTCM; Teensy 4 only");
+  }
+  Serial.println("placement,placed,dsp_cycles_per_pass,cycles_per_switch");
+  measure(Threads::PLACE_DTCM, "DTCM");
+  measure(Threads::PLACE_OCRAM, "OCRAM");
+  measure(Threads::PLACE_EXTMEM, "EXTMEM");
+}
+
+void loop() {
+}
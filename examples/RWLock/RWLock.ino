@@ -0,0 +1,86 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Benchmark: 8 reader threads and 1 writer thread share a calibration
+// table. Count how many table reads complete per second when the table
+// is guarded by a Threads::Mutex and when it is guarded by a
+// Threads::RWLock.
+
+const int READERS = 8;
+const int TABLE_SIZE = 64;
+const int RUN_MS = 2000;
+
+volatile int table[TABLE_SIZE];
+volatile int use_rwlock = 0;
+volatile int running = 0;
+volatile unsigned long reads = 0;
+volatile unsigned long writes = 0;
+
+Threads::Mutex mutex;
+Threads::RWLock rwlock;
+
+int sum_table() {
+  int sum = 0;
+  for (int i=0; i<TABLE_SIZE; i++) sum += table[i];
+  return sum;
+}
+
+void reader() {
+  while(1) {
+    if (! running) {
+      threads.yield();
+      continue;
+    }
+    if (use_rwlock) {
+      rwlock.lock_shared();
+      sum_table();
+      rwlock.unlock_shared();
+    }
+    else {
+      mutex.lock();
+      sum_table();
+      mutex.unlock();
+    }
+    reads++;
+  }
+}
+
+void writer() {
+  while(1) {
+    threads.delay(10);
+    if (! running) continue;
+    if (use_rwlock) rwlock.lock();
+    else mutex.lock();
+    for (int i=0; i<TABLE_SIZE; i++) table[i]++;
+    if (use_rwlock) rwlock.unlock();
+    else mutex.unlock();
+    writes++;
+  }
+}
+
+void run(const char *name, int rw) {
+  use_rwlock = rw;
+  reads = 0;
+  writes = 0;
+  running = 1;
+  threads.delay(RUN_MS);
+  running = 0;
+  Serial.print(name);
+  Serial.print(",");
+  Serial.print(reads * 1000 / RUN_MS);
+  Serial.print(",");
+  Serial.println(writes * 1000 / RUN_MS);
+  threads.delay(100);
+}
+
+void setup() {
+  delay(1000);
+  for (int i=0; i<READERS; i++) threads.addThread(reader);
+  threads.addThread(writer);
+  Serial.println("lock,reads_per_sec,writes_per_sec");
+  run("Mutex", 0);
+  run("RWLock", 1);
+}
+
+void loop() {
+}
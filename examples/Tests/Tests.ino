@@ -36,6 +36,174 @@ void my_priv_func_lock(void *lock) {
   m->unlock();
 }
 
+void periodic_func() {
+  p3++;
+}
+
+volatile int delay_us_late = -1;
+
+void delay_us_loop_func() {
+  while (1) threads.delay_us(Threads::DELAY_US_BLOCK);
+}
+
+unsigned long count_for_ms(int ms) {
+  volatile unsigned long n = 0;
+  uint32_t start = millis();
+  while ((int)(millis() - start) < ms) n++;
+  return n;
+}
+
+void delay_us_long_func() {
+  threads.delay_us(100000);
+}
+
+void delay_us_func() {
+  uint32_t start = micros();
+  threads.delay_us(200);
+  delay_us_late = micros() - start - 200;
+}
+
+int tls_slot;
+volatile int tls_other = -1;
+
+void tls_func() {
+  threads.setTLS(tls_slot, (void*)2);
+  threads.delay(50);
+  tls_other = (int)threads.getTLS(tls_slot);
+}
+
+volatile int malloc_count = 0;
+
+void malloc_func() {
+  for (int i=0; i<1000; i++) {
+    char *p = new char[16 + (i & 63)];
+    p[0] = i;
+    delete[] p;
+    malloc_count++;
+  }
+}
+
+volatile int arena_ok = 0;
+
+void arena_func() {
+  char *a = (char*)threads.arenaAlloc(10);
+  int mark = threads.arenaMark();
+  {
+    Threads::ArenaScope scope;
+    char *b = (char*)threads.arenaAlloc(100);
+    if (b && ((uint32_t)b & 7) == 0 && threads.inArena(b) == threads.id()) arena_ok++;
+  }
+  if (a && threads.arenaMark() == mark) arena_ok++;
+  if (threads.arenaAlloc(1000) == NULL) arena_ok++;
+}
+
+volatile int grow_result = 0;
+
+int __attribute__((noinline)) grow_recurse(int level, volatile int *outer) {
+  volatile int local[8];
+  local[0] = level;
+  threads.yield(); // give the switch a chance to grow the stack
+  if (level == 0) {
+    *outer = 42;
+    return local[0];
+  }
+  return grow_recurse(level-1, outer) + local[0] - level;
+}
+
+void grow_func() {
+  volatile int outer = 0;
+  int r = grow_recurse(40, &outer);
+  grow_result = (r == 0 && outer == 42);
+}
+
+volatile int handoff_seen = 0;
+
+void busy_func() {
+  while (1);
+}
+
+void handoff_func() {
+  while (1) {
+    handoff_seen++;
+    threads.yield();
+  }
+}
+
+volatile int static_count = 0;
+
+void static_func() {
+  while (1) {
+    static_count++;
+    threads.yield();
+  }
+}
+
+// defined suspended so it doesn't take time from the other tests
+uint8_t static_stack[1024] __attribute__((aligned(8)));
+Threads::StaticThread static_thread(static_func, 0, static_stack, sizeof(static_stack), 0, 0);
+
+Threads::Event test_event;
+volatile int event_result = -1;
+
+void event_func() {
+  event_result = test_event.wait();
+}
+
+volatile int timer_count[2];
+
+void timer_func(void *arg) {
+  timer_count[(int)arg]++;
+}
+
+Threads::Timer periodic_timer(timer_func, (void*)0);
+Threads::Timer oneshot_timer(timer_func, (void*)1);
+
+char work_log[8];
+int work_len = 0;
+
+void work_func(void *arg) {
+  if (work_len < 7) work_log[work_len++] = (char)(int)arg;
+}
+
+Threads::WorkQueue work_queue;
+Threads::Work work_a(work_func, (void*)'a');
+Threads::Work work_b(work_func, (void*)'b');
+
+// A periodic job holds job_lock from one job to the next while a background
+// thread waits for it; unlocking must not give that thread the job's CPU
+Threads::Mutex job_lock;
+volatile int job_holds = 0;
+volatile int bg_waiting = 0;
+volatile int contended_unlocks = 0;
+
+void spin_us(uint32_t us) {
+  uint32_t start = micros();
+  while (micros() - start < us) ;
+}
+
+void job_unlock_func() {
+  if (job_holds) {
+    if (bg_waiting) contended_unlocks++;
+    job_holds = 0;
+    job_lock.unlock();
+    spin_us(300);
+  }
+  else if (job_lock.try_lock()) {
+    job_holds = 1;
+  }
+}
+
+void bg_lock_func() {
+  while (1) {
+    bg_waiting = 1;
+    job_lock.lock();
+    bg_waiting = 0;
+    spin_us(5000);
+    job_lock.unlock();
+    threads.delay_us(2000);
+  }
+}
+
 Threads::Mutex count_lock;
 volatile int count1 = 0;
 volatile int count2 = 0;
@@ -108,6 +276,21 @@ bool endTransaction() { return 1; }
 bool other() { return 1; }
 };
 
+class CapturePrint : public Print {
+public:
+  char buf[64];
+  int n = 0;
+  size_t write(uint8_t c) { if (n < 63) buf[n++] = c; buf[n] = 0; return 1; }
+};
+
+CapturePrint capture;
+Threads::AsyncPrint async_log(capture, 64, 16);
+
+void async_print_func() {
+  async_log.print("ab");
+  async_log.println(12);
+}
+
 int stack_fault = 0;
 int stack_id = 0;
 
@@ -206,7 +389,9 @@ void runtest() {
 
   Serial.print("Test thread reinitialize ");
   p2 = 0;
+  threads.setDefaultStackPaint(true);
   id2 = threads.addThread(my_priv_func2);
+  threads.setDefaultStackPaint(false);
   delayx(200);
   if (p2 != 0) Serial.println("OK");
   else Serial.println("***FAIL***");
@@ -217,6 +402,11 @@ void runtest() {
   if (sz>=40 && sz<=48) Serial.println("OK");
   else Serial.println("***FAIL***");
 
+  Serial.print("Test stack high water ");
+  int hw = threads.getStackHighWater(id2);
+  if (hw>=sz && hw<threads.DEFAULT_STACK_SIZE) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
   Serial.print("Test thread suspend ");
   delayx(200);
   threads.suspend(id2);
@@ -300,6 +490,21 @@ void runtest() {
   else Serial.println("***FAIL***");
 
 
+  Serial.print("Test nested scheduler lock ");
+  {
+    Threads::lockScheduler();
+    Threads::lockScheduler();
+    save_p = p1;
+    delayx(200);
+    Threads::unlockScheduler();
+    delayx(200);
+    int still = (save_p == p1);
+    Threads::unlockScheduler();
+    delayx(200);
+    if (still && save_p != p1 && currentLock == 0) Serial.println("OK");
+    else Serial.println("***FAIL***");
+  }
+
   Serial.print("Test mutex lock state ");
   Threads::Mutex mx;
   mx.lock();
@@ -331,6 +536,12 @@ void runtest() {
   //else if (ratio_test(count1, count3, 1.2)) Serial.println("***FAIL***");
   else Serial.println("OK");
 
+  Serial.print("Test state transitions ");
+  delayx(10);
+  if (threads.getState(id1) == Threads::ENDED && threads.restart(id1) == -1
+      && threads.suspend(id1) == -1 && threads.getState(id1) == Threads::ENDED) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
   Serial.print(count1);
   Serial.print(" ");
   Serial.print(count2);
@@ -338,6 +549,148 @@ void runtest() {
   Serial.print(count3);
   Serial.println();
 
+  Serial.print("Test periodic thread ");
+  p3 = 0;
+  id1 = threads.addPeriodicThread(periodic_func, 10000);
+  delayx(1000);
+  threads.kill(id1);
+  if (p3 >= 95 && p3 <= 105 && threads.getPeriodic(id1)->misses == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test periodic thread above a normal thread ");
+  id1 = threads.addThread(my_priv_func2);
+  id2 = threads.addPeriodicThread(periodic_func, 1000);
+  delayx(200);
+  save_p = p2;
+  delayx(100);
+  threads.kill(id2);
+  threads.kill(id1);
+  if (id1 < id2 && p2 > save_p) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test periodic job unlocking a contended mutex ");
+  id1 = threads.addPeriodicThread(job_unlock_func, 10000, 3000);
+  id2 = threads.addThread(bg_lock_func);
+  delayx(1000);
+  threads.kill(id1);
+  threads.kill(id2);
+  if (contended_unlocks > 0 && threads.getPeriodic(id1)->misses == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test thread budget ");
+  id1 = threads.addThread(my_priv_func3);
+  threads.setBudget(id1, 2, 20);
+  delayx(500);
+  int overruns = threads.getBudgetOverruns(id1);
+  threads.kill(id1);
+  if (overruns >= 15 && overruns <= 30) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test delay_us wake ");
+  id1 = threads.addThread(my_priv_func3);
+  id2 = threads.addThread(delay_us_func);
+  threads.wait(id2, 1000);
+  threads.kill(id1);
+  if (delay_us_late >= 0 && delay_us_late < 50) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test timer wakes don't starve the main thread ");
+  id1 = threads.addThread(my_priv_func3);
+  unsigned long alone = count_for_ms(100);
+  id2 = threads.addThread(delay_us_loop_func);
+  unsigned long woken = count_for_ms(100);
+  threads.kill(id2);
+  threads.kill(id1);
+  if (woken > alone / 3) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test wait for a blocked thread ");
+  uint32_t join_start = millis();
+  id2 = threads.addThread(delay_us_long_func);
+  r = threads.wait(id2, 1000);
+  join_start = millis() - join_start;
+  if (r == id2 && join_start >= 99 && threads.getState(id2) == Threads::ENDED) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test mutex lock timeout ");
+  mx.lock();
+  uint32_t lock_start = micros();
+  r = mx.lock_us(500);
+  lock_start = micros() - lock_start;
+  mx.unlock();
+  if (r == 0 && lock_start >= 500 && lock_start < 2000) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test RWLock shared ");
+  Threads::RWLock rw;
+  rw.lock_shared();
+  if (rw.try_lock_shared() == 1 && rw.try_lock() == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+  rw.unlock_shared();
+  rw.unlock_shared();
+
+  Serial.print("Test RWLock exclusive ");
+  rw.lock();
+  if (rw.try_lock_shared() == 0 && rw.try_lock() == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+  rw.unlock();
+
+  Serial.print("Test thread local slots ");
+  tls_slot = threads.allocTLS();
+  threads.setTLS(tls_slot, (void*)1);
+  threads.addThread(tls_func);
+  threads.delay(100);
+  if (tls_slot >= 0 && tls_other == 2 && threads.getTLS(tls_slot) == (void*)1) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test malloc from threads ");
+  Threads::RecursiveMutex rm;
+  int rm_ok = rm.lock() && rm.lock() && rm.unlock() && rm.unlock() && rm.try_lock() && rm.unlock();
+  int m1 = threads.addThread(malloc_func);
+  int m2 = threads.addThread(malloc_func);
+  threads.wait(m1, 5000);
+  threads.wait(m2, 5000);
+  if (rm_ok && malloc_count == 2000) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test thread arena ");
+  int arena_id = threads.addThread(arena_func, 0, 1024, 0, 256);
+  threads.wait(arena_id, 1000);
+  if (arena_ok == 3 && threads.getArenaUsed(arena_id) == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test stack growth ");
+  int grow_id = threads.addThread(grow_func, 0, Threads::STACK_SMALL);
+  threads.setStackGrowth(grow_id, Threads::GROW_RELOCATE, Threads::STACK_LARGE);
+  threads.wait(grow_id, 2000);
+  if (grow_result && threads.getStackGrowths(grow_id) == 1) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test yieldTo ");
+  int busy_id = threads.addThread(busy_func);   // next in line, and never yields
+  int handoff_id = threads.addThread(handoff_func);
+  threads.delay(50);
+  handoff_seen = 0;
+  uint32_t handoff_us = micros();
+  int yield_ok = threads.yieldTo(handoff_id);
+  handoff_us = micros() - handoff_us;
+  int seen = handoff_seen;
+  threads.kill(busy_id);
+  threads.kill(handoff_id);
+  threads.delay(50);
+  if (yield_ok && seen >= 1 && handoff_us < 5000 && threads.yieldTo(handoff_id) == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test Published snapshot ");
+  Threads::Published<int> pub(5);
+  int pub_value = 0;
+  pub.read(pub_value);
+  int pub_ok = (pub_value == 5 && pub.version() == 0);
+  pub.publish(7);
+  pub.publish(9);
+  if (pub_ok && pub.read() == 9 && pub.version() == 2) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
   Serial.print("Test std::mutex lock ");
   std::mutex g_mutex;
   {
@@ -367,6 +720,72 @@ void runtest() {
   if (subinst.test(&(sub2.getLock())) == 1) Serial.println("OK");
   else Serial.println("***FAIL***");
 
+  Serial.print("Test Grab scope ");
+  int grab_locked;
+  {
+    auto g = sub2.grab();
+    g->h(30);
+    grab_locked = sub2.getLock().getState();
+  }
+  if (grab_locked == 1 && sub2.getLock().getState() == 0 && sub2->getValue() == 30) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test event ");
+  int event_id = threads.addThread(event_func);
+  threads.delay(10);
+  int event_ok = (event_result == -1 && threads.getState(event_id) == Threads::WAITING);
+  if (threads.wait(event_id, 20) != -1) event_ok = 0;  // blocked, not ended
+  test_event.signal();
+  if (threads.wait(event_id, 100) != event_id) event_ok = 0;
+  if (event_ok && event_result == 1 && test_event.wait(1000) == 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test timers ");
+  Threads::Timer::begin(1024, 2);  // the daemon waits off the run list from here on
+  periodic_timer.start(10000, 10000);
+  oneshot_timer.start(25000);
+  threads.delay(105);
+  periodic_timer.stop();
+  int timer_ok = (timer_count[0] >= 9 && timer_count[0] <= 11 && timer_count[1] == 1);
+  int save_count = timer_count[0];
+  threads.delay(30);
+  if (timer_ok && timer_count[0] == save_count && ! oneshot_timer.isActive()) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test work queue ");
+  work_queue.begin();
+  {
+    Threads::Suspend hold; // post all three before the worker runs
+    work_queue.post(work_a);
+    work_queue.post(work_b);
+    if (work_queue.post(work_a) != 0) work_len = 7;  // already queued
+  }
+  threads.delay(10);
+  work_queue.post(work_b);
+  threads.delay(10);
+  if (strcmp(work_log, "abb") == 0 && ! work_a.isPending()) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test static thread ");
+  int static_id = static_thread.id();
+  int static_ok = (static_id > 0 && threads.getState(static_id) == Threads::SUSPENDED && static_count == 0);
+  threads.restart(static_id);
+  threads.delay(20);
+  threads.kill(static_id);
+  if (static_ok && static_count > 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
+  Serial.print("Test AsyncPrint ");
+  int drain_id = async_log.begin();
+  threads.addThread(async_print_func);
+  threads.delay(20);
+  int async_ok = (strcmp(capture.buf, "ab12\r\n") == 0);
+  for (int i=0; i<8; i++) async_log.println("0123456789");
+  threads.delay(20);
+  threads.kill(drain_id);
+  if (async_ok && async_log.getDropped() > 0) Serial.println("OK");
+  else Serial.println("***FAIL***");
+
   Serial.print("Test thread stack overflow ");
   uint8_t *mstack = new uint8_t[1024];
   stack_id = threads.addThread(recursive_thread, 0, 512, mstack+512);
@@ -374,6 +793,17 @@ void runtest() {
   threads.kill(stack_id);
   if (stack_fault) Serial.println("OK");
   else Serial.println("***FAIL***");
+
+  if (threads.setStackGuard(true)) {
+    Serial.print("Test thread stack guard ");
+    stack_fault = 0;
+    stack_id = threads.addThread(recursive_thread, 0, 512, mstack+512);
+    threads.delay(2000);
+    threads.kill(stack_id);
+    threads.setStackGuard(false);
+    if (stack_fault && threads.testStackMarkers() == 0) Serial.println("OK");
+    else Serial.println("***FAIL***");
+  }
   delete[] mstack;
 }
 
@@ -0,0 +1,44 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Blink an LED and print a heartbeat with software timers instead of a
+// thread (and a stack) each. A pin interrupt restarts a one-shot timer, so
+// "idle" is printed once the button has been left alone for 2 seconds.
+
+const int LED = 13;
+const int BUTTON = 2;
+
+void blink(void *arg) {
+  digitalWrite(LED, ! digitalRead(LED));
+}
+
+void heartbeat(void *arg) {
+  Serial.print("heartbeat ");
+  Serial.println(millis());
+}
+
+void idle(void *arg) {
+  Serial.println("idle");
+}
+
+Threads::Timer blink_timer(blink);
+Threads::Timer heartbeat_timer(heartbeat);
+Threads::Timer idle_timer(idle);
+
+void button_isr() {
+  idle_timer.start(2000000);  // timers can be started from interrupts
+}
+
+void setup() {
+  delay(1000);
+  pinMode(LED, OUTPUT);
+  pinMode(BUTTON, INPUT_PULLUP);
+  Threads::Timer::begin();
+  blink_timer.start(0, 250000);
+  heartbeat_timer.start(1000000, 1000000);
+  idle_timer.start(2000000);
+  attachInterrupt(BUTTON, button_isr, FALLING);
+}
+
+void loop() {
+}
@@ -0,0 +1,49 @@
+#include <Arduino.h>
+#include "TeensyThreads.h"
+
+// Measure the cost of threads.yield() from the main thread with 0, 1 and 8
+// other threads ready to run. Each other thread just yields back, so one
+// call from the main thread goes once around all of them. With no other
+// thread ready, yield() returns without a context switch. Prints CSV.
+
+const int CALLS = 10000;
+
+volatile int spinning = 1;
+
+void yield_thread() {
+  while (spinning) threads.yield();
+}
+
+void measure(int others) {
+  int ids[8];
+  spinning = 1;
+  for (int i=0; i<others; i++) ids[i] = threads.addThread(yield_thread);
+  threads.yield(); // let them all start
+
+  uint32_t start = ARM_DWT_CYCCNT;
+  for (int i=0; i<CALLS; i++) threads.yield();
+  uint32_t cycles = ARM_DWT_CYCCNT - start;
+
+  spinning = 0;
+  for (int i=0; i<others; i++) threads.wait(ids[i], 100);
+
+  Serial.print(others);
+  Serial.print(",");
+  Serial.print((float)cycles / CALLS);
+  Serial.print(",");
+  Serial.println((float)cycles / CALLS / (others + 1));
+}
+
+void setup() {
+  delay(1000);
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;  // make sure the cycle counter runs
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  threads.setDefaultStackSize(512);
+  Serial.println("other_threads,cycles_per_yield,cycles_per_switch");
+  measure(0);
+  measure(1);
+  measure(8);
+}
+
+void loop() {
+}